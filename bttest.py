@@ -35,6 +35,53 @@ async def wait_for_response():
         raise Exception("Timeout waiting for response")
 
 
+class PipelinedClient:
+    """Tags commands with "#<id> " so several can be in flight at once.
+
+    Replies are matched back to their request by the echoed "id" field, and
+    at most `window` requests are outstanding (the device reports its window
+    in getStatus).
+    """
+
+    def __init__(self, client: BleakClient, window: int = 1):
+        self.client = client
+        self.window = asyncio.Semaphore(window)
+        self.pending: dict[int, asyncio.Future] = {}
+        self.next_id = 1
+
+    def set_window(self, window: int):
+        self.window = asyncio.Semaphore(window)
+
+    def on_payload(self, payload) -> bool:
+        """Resolve the matching request; False if the payload is not a reply."""
+        if not isinstance(payload, dict) or "id" not in payload:
+            return False
+        future = self.pending.pop(payload["id"], None)
+        if future is None or future.done():
+            return False
+        future.set_result(payload)
+        return True
+
+    async def request(self, cmd: str, timeout: float = 5.0):
+        async with self.window:
+            request_id = self.next_id
+            self.next_id += 1
+            future = asyncio.get_running_loop().create_future()
+            self.pending[request_id] = future
+            await self.client.write_gatt_char(
+                RX_UUID, (f"#{request_id} {cmd}\n").encode()
+            )
+            try:
+                reply = await asyncio.wait_for(future, timeout=timeout)
+            except asyncio.TimeoutError:
+                raise Exception(f"Timeout waiting for response to #{request_id} {cmd}")
+            finally:
+                self.pending.pop(request_id, None)
+            if reply.get("status") == "busy":
+                raise Exception(f"Device pipeline full for #{request_id} {cmd}")
+            return reply
+
+
 async def main():
     esp_device = await acquire_device()
     if not esp_device:
@@ -46,7 +93,7 @@ async def main():
 
         # toriaezu sync the time
         await client.write_gatt_char(
-            RX_UUID, (f"setTime {int(time.time())}\n").encode()
+            RX_UUID, (f"setTime {time.time():.3f}\n").encode()
         )
 
         # Notification handler
@@ -80,6 +127,7 @@ async def demo_data_fetch():
     esp_device = await acquire_device()
     async with BleakClient(esp_device.address) as client:
         print(f"Connected to {esp_device.name} [{esp_device.address}]")
+        pipeline = PipelinedClient(client)
 
         # Add the notification handler setup
         def handle_rx(_, data):
@@ -89,45 +137,42 @@ async def demo_data_fetch():
                 yaml_string = yaml.safe_dump(mixed_payload, default_flow_style=False)
                 print(f"\n< {len(payload_string)}")
                 print("< " + indent(yaml_string, "+ ").lstrip("+ "))
-                response_queue.put_nowait(payload_string)
+                if not pipeline.on_payload(mixed_payload):
+                    response_queue.put_nowait(payload_string)
             except json.JSONDecodeError:
                 print(f"< {payload_string}")
 
         await client.start_notify(TX_UUID, handle_rx)
 
         # Now continue with the rest of the function
-        await client.write_gatt_char(RX_UUID, b"getStatus\n")
-        status_response = await wait_for_response()
-        status = json.loads(status_response)
-        total_records = status["bufferSize"]
+        status = await pipeline.request("getStatus")
+        pipeline.set_window(status.get("window", 1))
+
+        # Records are addressed by seq, not index: the device sheds old
+        # measurements when it fills up, which moves every index behind them.
+        # "page" is how many records fit one notification at this MTU.
+        first, end, chunk_size = status["firstSeq"], status["nextSeq"], status["page"]
 
+        # First phase: Read all records, keeping the pipeline window full
+        starts = range(first, end, chunk_size)
+        chunks = await asyncio.gather(
+            *(pipeline.request(f"readRange {seq} {min(chunk_size, end - seq)}") for seq in starts)
+        )
         all_records = []
-        chunk_size = 5
-        records_read = 0
-
-        # First phase: Read all records
-        while records_read < total_records:
-            cmd = f"readBuffer {records_read} {chunk_size}\n"
-            await client.write_gatt_char(RX_UUID, cmd.encode())
-            chunk_response = await wait_for_response()
-            chunk_data = json.loads(chunk_response)
-
-            # Store the records
-            all_records.extend(chunk_data["records"])
-            records_read += chunk_data["length"]
-
-            # If we got fewer records than requested, we're done
-            if chunk_data["length"] < chunk_size:
-                break
+        read_up_to = first
+        for start, chunk_data in zip(starts, chunks):
+            stop = min(start + chunk_size, end)
+            while True:
+                all_records.extend(chunk_data["records"])
+                read_up_to = chunk_data["next"]
+                if read_up_to >= stop:
+                    break
+                # Unusually long records did not all fit; fetch the rest
+                chunk_data = await pipeline.request(f"readRange {read_up_to} {stop - read_up_to}")
 
-        # Second phase: Drop the records we read (in chunks)
-        records_to_drop = records_read
-        while records_to_drop > 0:
-            drop_size = min(chunk_size, records_to_drop)
-            cmd = f"dropRecords 0 {drop_size}\n"  # Always drop from start
-            await client.write_gatt_char(RX_UUID, cmd.encode())
-            await wait_for_response()
-            records_to_drop -= drop_size
+        # Second phase: Drop what we read. Safe to repeat, and it leaves
+        # anything logged since getStatus alone.
+        await pipeline.request(f"dropBefore {read_up_to}")
 
         print(f"retrieved {len(all_records)} records")
         for record in all_records:
@@ -136,18 +181,176 @@ async def demo_data_fetch():
         return all_records
 
 
+async def bench_sampling(duration: float = 30.0):
+    """Hammer readBuffer for `duration` seconds and report the worst gap
+    between two sensor reads on the device (getStats maxGapUs)."""
+    esp_device = await acquire_device()
+    async with BleakClient(esp_device.address) as client:
+        print(f"Connected to {esp_device.name} [{esp_device.address}]")
+        pipeline = PipelinedClient(client)
+
+        def handle_rx(_, data):
+            try:
+                pipeline.on_payload(json.loads(data.decode(errors="ignore")))
+            except json.JSONDecodeError:
+                pass
+
+        await client.start_notify(TX_UUID, handle_rx)
+        status = await pipeline.request("getStatus")
+        pipeline.set_window(status.get("window", 1))
+        await pipeline.request("resetStats")
+
+        # A page that fits one notification at this MTU; a longer one is cut
+        # off, never parses, and the bench would only measure timeouts
+        page = status["page"]
+        exports = 0
+        deadline = time.monotonic() + duration
+        while time.monotonic() < deadline:
+            await asyncio.gather(
+                *(pipeline.request(f"readBuffer 0 {page}") for _ in range(status.get("window", 1)))
+            )
+            exports += status.get("window", 1)
+
+        stats = await pipeline.request("getStats")
+        print(
+            f"{exports} exports in {duration:.0f}s: "
+            f"max sample gap {stats['maxGapUs']} us, mean {stats['meanGapUs']} us"
+        )
+
+
+async def capture_raw(seconds: float, rate: float, path: str):
+    """Run captureRaw, then download it as a trace for tools/*_eval."""
+    esp_device = await acquire_device()
+    async with BleakClient(esp_device.address) as client:
+        print(f"Connected to {esp_device.name} [{esp_device.address}]")
+        pipeline = PipelinedClient(client)
+
+        def handle_rx(_, data):
+            try:
+                pipeline.on_payload(json.loads(data.decode(errors="ignore")))
+            except json.JSONDecodeError:
+                pass
+
+        await client.start_notify(TX_UUID, handle_rx)
+        status = await pipeline.request("getStatus")
+        window = status.get("window", 1)
+        pipeline.set_window(window)
+
+        cmd = f"captureRaw {seconds}" + (f" {rate}" if rate else "")
+        reply = await pipeline.request(cmd)
+        if reply.get("status") != "ok":
+            raise Exception(f"captureRaw failed: {reply}")
+
+        try:
+            while (await pipeline.request("getStats"))["capture"] != "done":
+                await asyncio.sleep(0.5)
+        except (KeyboardInterrupt, asyncio.CancelledError):
+            await pipeline.request("captureStop")
+            raise
+
+        cal = await pipeline.request("getCalibration")
+        # The device fills each page up to what one notification holds;
+        # the first one tells how many that is at this MTU
+        first = await pipeline.request("readCapture 0")
+        total = first["total"]
+        page = max(first["length"], 1)
+        starts = range(page, total, page)
+        pages = [first] + await asyncio.gather(
+            *(pipeline.request(f"readCapture {offset} {page}") for offset in starts)
+        )
+        for i, offset in enumerate(range(0, total, page)):
+            # Later timestamps have more digits, so a page can come back short
+            stop = min(offset + page, total)
+            got = offset + pages[i]["length"]
+            while got < stop:
+                rest = await pipeline.request(f"readCapture {got} {stop - got}")
+                pages[i]["t"] += rest["t"]
+                pages[i]["raw"] += rest["raw"]
+                got += rest["length"]
+
+        # Same "ms,raw" format the host replay tools read, with the tare applied
+        tare = first["tareOffset"]
+        with open(path, "w") as f:
+            f.write(f"# captureRaw {seconds}s rate={rate or 'full'} tareOffset={tare}\n")
+            f.write(f"# cal {cal['noLoad']},{cal['atLoad']},{cal['weight']}\n")
+            for chunk in pages:
+                for t_us, raw in zip(chunk["t"], chunk["raw"]):
+                    f.write(f"{t_us // 1000},{raw - tare}\n")
+        print(f"wrote {total} samples to {path}")
+
+
+async def watch():
+    """Subscribe to pushes and collect whatever the device streams to us."""
+    esp_device = await acquire_device()
+    async with BleakClient(esp_device.address) as client:
+        print(f"Connected to {esp_device.name} [{esp_device.address}]")
+        pipeline = PipelinedClient(client)
+        pushes: AsyncQueue[dict] = AsyncQueue()
+
+        def handle_rx(_, data):
+            payload_string = data.decode(errors="ignore")
+            try:
+                payload = json.loads(payload_string)
+            except json.JSONDecodeError:
+                print(f"< {payload_string}")
+                return
+            if not pipeline.on_payload(payload) and "event" in payload:
+                pushes.put_nowait(payload)
+
+        await client.start_notify(TX_UUID, handle_rx)
+        status = await pipeline.request("getStatus")
+        pipeline.set_window(status.get("window", 1))
+        await pipeline.request("subscribe stream")
+
+        streamed = []
+        stream_from = None  # seq where our contiguous copy starts
+        stream_next = None  # ... and where it ends
+        while True:
+            push = await pushes.get()
+            event = push["event"]
+            if event == "records":
+                if stream_from is None:
+                    stream_from = stream_next = push["from"]
+                if push["from"] == stream_next:
+                    streamed.extend(push["records"])
+                    stream_next = push["next"]
+                else:
+                    # A page went missing; keep what is contiguous
+                    print(f"< gap in stream at seq {stream_next}")
+            elif event == "streamEnd":
+                # Free only what we actually got, from where the stream began
+                if stream_from == push["from"] and stream_next > stream_from:
+                    await pipeline.request(f"dropBefore {stream_next}")
+                print(f"streamed {len(streamed)} records")
+                for record in streamed:
+                    print(record)
+                streamed = []
+                stream_from = stream_next = None
+            else:
+                print(f"< {push}")
+
+
 if __name__ == "__main__":
     import argparse
 
     parser = argparse.ArgumentParser(description="BLE scale data tools")
     parser.add_argument(
         "command",
-        choices=["cli", "fetch"],
+        choices=["cli", "fetch", "watch", "bench", "capture"],
         help="Command to run: interactive command line or fetch data",
     )
+    parser.add_argument("--seconds", type=float, default=10, help="capture length")
+    parser.add_argument("--rate", type=float, default=0, help="capture rate, 0 = full")
+    parser.add_argument("--out", default="capture.txt", help="capture trace file")
     args = parser.parse_args()
 
     if args.command == "cli":
         asyncio.run(main())
     elif args.command == "fetch":
         asyncio.run(demo_data_fetch())
+    elif args.command == "watch":
+        asyncio.run(watch())
+    elif args.command == "bench":
+        asyncio.run(bench_sampling())
+    elif args.command == "capture":
+        asyncio.run(capture_raw(args.seconds, args.rate, args.out))
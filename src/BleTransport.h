@@ -0,0 +1,131 @@
+#pragma once
+#include <BLEDevice.h>
+#include <BLEServer.h>
+#include <BLEUtils.h>
+#include <BLE2902.h>
+#include "Transport.h"
+
+// BLE UUIDs
+#define SERVICE_UUID "6e400001-b5a3-f393-e0a9-e50e24dcca9e"
+#define CHARACTERISTIC_RX "6e400002-b5a3-f393-e0a9-e50e24dcca9e"
+#define CHARACTERISTIC_TX "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
+
+#define BLE_DEFAULT_MTU 23 // until the client asks for more
+
+// Nordic-UART-style BLE service: writes to RX come in, TX notifies go out
+class BleTransport : public Transport
+{
+private:
+    BLEServer *pServer = nullptr;
+    BLECharacteristic *pTxCharacteristic = nullptr;
+    volatile bool deviceConnected = false;
+    // Kept from the callbacks: BLEServer::getPeerMTU() looks the connection
+    // up without checking it is still there
+    volatile uint16_t peerMtu = BLE_DEFAULT_MTU;
+    bool notifyFailed = false; // set by TxCallbacks from inside notify()
+
+    class ServerCallbacks : public BLEServerCallbacks
+    {
+        BleTransport &transport;
+
+    public:
+        ServerCallbacks(BleTransport &t) : transport(t) {}
+        void onConnect(BLEServer *pServer) override
+        {
+            transport.peerMtu = BLE_DEFAULT_MTU;
+            transport.deviceConnected = true;
+            if (transport.connectionHandler)
+                transport.connectionHandler(true);
+        }
+        void onDisconnect(BLEServer *pServer) override
+        {
+            transport.deviceConnected = false;
+            if (transport.connectionHandler)
+                transport.connectionHandler(false);
+            delay(100);                         // brief delay helps stack clean up
+            pServer->getAdvertising()->start(); // RESTART ADVERTISING
+            Serial.println("Disconnected, advertising restarted");
+        }
+        void onMtuChanged(BLEServer *pServer, esp_ble_gatts_cb_param_t *param) override
+        {
+            transport.peerMtu = param->mtu.mtu;
+        }
+    };
+
+    class CharCallbacks : public BLECharacteristicCallbacks
+    {
+        BleTransport &transport;
+
+    public:
+        CharCallbacks(BleTransport &t) : transport(t) {}
+        void onWrite(BLECharacteristic *pCharacteristic) override
+        {
+            std::string rxValue = pCharacteristic->getValue();
+            if (!rxValue.empty() && transport.receiveHandler)
+            {
+                transport.receiveHandler(rxValue.data(), rxValue.size());
+            }
+        }
+    };
+
+    // notify() reports through onStatus() before it returns
+    class TxCallbacks : public BLECharacteristicCallbacks
+    {
+        BleTransport &transport;
+
+    public:
+        TxCallbacks(BleTransport &t) : transport(t) {}
+        void onStatus(BLECharacteristic *pCharacteristic, Status s, uint32_t code) override
+        {
+            // The stack refused it, or the client is gone. Notifications
+            // the client has switched off are as good as delivered.
+            if (s == Status::ERROR_GATT || s == Status::ERROR_NO_CLIENT)
+                transport.notifyFailed = true;
+        }
+    };
+
+public:
+    void begin() override
+    {
+        BLEDevice::init("ESP32-Scale");
+        pServer = BLEDevice::createServer();
+        pServer->setCallbacks(new ServerCallbacks(*this));
+
+        BLEService *pService = pServer->createService(SERVICE_UUID);
+
+        pTxCharacteristic = pService->createCharacteristic(
+            CHARACTERISTIC_TX,
+            BLECharacteristic::PROPERTY_NOTIFY);
+        pTxCharacteristic->addDescriptor(new BLE2902());
+        pTxCharacteristic->setCallbacks(new TxCallbacks(*this));
+
+        BLECharacteristic *pRxCharacteristic = pService->createCharacteristic(
+            CHARACTERISTIC_RX,
+            BLECharacteristic::PROPERTY_WRITE);
+        pRxCharacteristic->setCallbacks(new CharCallbacks(*this));
+
+        pService->start();
+        pServer->getAdvertising()->start();
+        Serial.println("BLE UART started, waiting for connections...");
+    }
+
+    bool isConnected() const override { return deviceConnected; }
+
+    // Only called from the command task
+    bool send(const char *data, size_t length) override
+    {
+        if (!deviceConnected)
+            return false;
+        notifyFailed = false;
+        pTxCharacteristic->setValue((uint8_t *)data, length);
+        pTxCharacteristic->notify();
+        return !notifyFailed;
+    }
+
+    // ATT notification payload for the negotiated MTU; the default once the
+    // link is gone, since replies to queued commands still ask
+    size_t getMaxPayload() const override
+    {
+        return deviceConnected ? peerMtu - 3 : BLE_DEFAULT_MTU - 3;
+    }
+};
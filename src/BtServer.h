@@ -1,88 +1,345 @@
 #pragma once
-#include <BLEDevice.h>
-#include <BLEServer.h>
-#include <BLEUtils.h>
-#include <BLE2902.h>
+#include <atomic>
 #include <mutex>
 #include <deque>
 #include "DataLogger.h"
+#include "SipDetector.h"
+#include "WarmState.h"
+#include "SamplingStats.h"
+#include "RawCapture.h"
 #include "StatusPrinter.h"
+#include "Transport.h"
 
-// BLE UUIDs
-#define SERVICE_UUID "6e400001-b5a3-f393-e0a9-e50e24dcca9e"
-#define CHARACTERISTIC_RX "6e400002-b5a3-f393-e0a9-e50e24dcca9e"
-#define CHARACTERISTIC_TX "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
+// Request-ID pipelining: a command may be prefixed with "#<id> ". Every reply
+// to it then carries "id":<id>, and commands that used to reply nothing send
+// an explicit ack. Clients may keep up to PIPELINE_WINDOW such requests
+// outstanding; anything beyond that is answered with "busy".
+#define PIPELINE_WINDOW 8
+#define COMMAND_EXPIRY_MS 1000
+#define NO_REQUEST_ID -1
+
+// Commands run on their own task next to the BLE stack, off the sampling core
+#define COMMAND_TASK_CORE 0
+#define COMMAND_TASK_STACK 8192
+#define COMMAND_TASK_POLL_MS 20 // also paces pushes and export streams
+
+#define MAX_SAMPLING_RATE_HZ 100 // the boot default; the HX711 converts at 80 Hz at most
+
+// Unsolicited pushes to subscribed clients (see `subscribe`). Only watermark
+// pushes count against the limit; sips and refills are always queued.
+#define MAX_PENDING_PUSHES 16
+#define MAX_PUSHES_PER_PASS 4 // and the link's queue has the last word
+#define STREAM_PAGE_PREFIX "{\"event\":\"records\","
 
 class BtServer
 {
 private:
-    BLEServer *pServer;
-    BLECharacteristic *pTxCharacteristic;
-    bool deviceConnected = false;
+    Transport &transport;
     std::mutex commandMutex;
     String incomingBuffer;
-    int &samplingRateHz;
+    std::atomic<int> &samplingRateHz; // sets the loop's delay between reads
+    TaskHandle_t commandTask = nullptr;
 
     struct QueuedCommand
     {
         String command;
         unsigned long timestamp;
-        QueuedCommand(const String &cmd) : command(cmd), timestamp(millis()) {}
+        long requestId = NO_REQUEST_ID;
+        bool overflow = false; // arrived with the pipeline window already full
+
+        QueuedCommand(const String &cmd) : command(cmd), timestamp(millis())
+        {
+            if (cmd.startsWith("#"))
+            {
+                int spaceIdx = cmd.indexOf(' ');
+                requestId = cmd.substring(1, spaceIdx == -1 ? cmd.length() : spaceIdx).toInt();
+                command = (spaceIdx == -1) ? "" : cmd.substring(spaceIdx + 1);
+            }
+        }
     };
     std::deque<QueuedCommand> commandQueue;
 
-    class ServerCallbacks : public BLEServerCallbacks
+    // Request being handled right now, echoed by notify()
+    long currentRequestId = NO_REQUEST_ID;
+    bool replied = false;
+    unsigned long currentCommandReceived = 0; // millis() when it arrived
+
+    enum Subscription
     {
-        BtServer &server;
+        SUB_NONE,
+        SUB_EVENTS, // push a summary on sips, refills and watermarks
+        SUB_STREAM  // ... and export the buffer when a watermark is crossed
+    };
+    volatile Subscription subscription = SUB_NONE;
 
-    public:
-        ServerCallbacks(BtServer &s) : server(s) {}
-        void onConnect(BLEServer *pServer) override { server.deviceConnected = true; }
-        void onDisconnect(BLEServer *pServer) override
+    // Filled by the DataLogger listener, drained by processCommands(). The
+    // listener runs on the sampling loop for sips, refills and watermarks,
+    // so it only queues the event; the JSON is built on the command task.
+    std::mutex pushMutex;
+    std::deque<LoggerEvent> pushQueue;
+    size_t queuedWatermarks = 0; // of pushQueue, held to MAX_PENDING_PUSHES
+    size_t shedSincePush = 0; // back-pressure, folded into one push
+    bool streamRequested = false;
+    bool streaming = false;
+    uint32_t streamFrom = 0; // seq range of the export in progress
+    uint32_t streamNext = 0;
+    uint32_t streamStop = 0;
+
+    // Assembles newline-terminated commands from whatever the link delivers
+    void onReceive(const char *data, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
         {
-            server.deviceConnected = false;
-            delay(100);                         // brief delay helps stack clean up
-            pServer->getAdvertising()->start(); // RESTART ADVERTISING
-            Serial.println("Disconnected, advertising restarted");
+            char c = data[i];
+            if (c == '\n')
+            {
+                QueuedCommand cmd(incomingBuffer);
+                commandMutex.lock();
+                cmd.overflow = commandQueue.size() >= PIPELINE_WINDOW;
+                commandQueue.push_back(cmd);
+                commandMutex.unlock();
+                if (commandTask)
+                    xTaskNotifyGive(commandTask);
+                incomingBuffer = "";
+            }
+            else
+            {
+                incomingBuffer += c;
+            }
         }
-    };
+    }
 
-    class CharCallbacks : public BLECharacteristicCallbacks
+    // "1712345678" or "1712345678.25" -> epoch ms, 0 if invalid
+    static EventTime parseEventTime(const String &text)
     {
-        BtServer &server;
+        char *end;
+        long long seconds = strtoll(text.c_str(), &end, 10);
+        if (end == text.c_str() || seconds <= 0)
+            return 0;
 
-    public:
-        CharCallbacks(BtServer &s) : server(s) {}
-        void onWrite(BLECharacteristic *pCharacteristic) override
+        int millisPart = 0;
+        if (*end == '.')
         {
-            std::string rxValue = pCharacteristic->getValue();
-            if (!rxValue.empty())
+            int scale = 100;
+            for (const char *c = end + 1; *c >= '0' && *c <= '9' && scale > 0; c++, scale /= 10)
+                millisPart += (*c - '0') * scale;
+        }
+        return (EventTime)seconds * 1000 + millisPart;
+    }
+
+    bool send(const char *value)
+    {
+        return transport.isConnected() && transport.send(value, strlen(value));
+    }
+
+    // Longest reply to the current command that still fits one notification
+    // once notify() has spliced in its "id":<n>,
+    size_t replyBudget() const
+    {
+        size_t maxPayload = transport.getMaxPayload();
+        size_t tag = currentRequestId == NO_REQUEST_ID ? 0 : String(currentRequestId).length() + 6;
+        return maxPayload > tag ? maxPayload - tag : 0;
+    }
+
+    // readRange count that always fits one reply, for records of ordinary size
+    size_t pageRecords() const
+    {
+        size_t budget = replyBudget();
+        return budget > RANGE_JSON_ENVELOPE ? max((size_t)1, (budget - RANGE_JSON_ENVELOPE) / RECORD_JSON_MAX) : 1;
+    }
+
+    // A reply longer than one notification would arrive cut off and never
+    // parse; say so instead, so the client does not wait for a timeout
+    void sendReply(const String &reply)
+    {
+        if (reply.length() <= transport.getMaxPayload())
+        {
+            send(reply.c_str());
+            return;
+        }
+        Serial.printf("Reply too long: %u > %u bytes\n", (unsigned)reply.length(), (unsigned)transport.getMaxPayload());
+        String error = "{";
+        if (currentRequestId != NO_REQUEST_ID)
+            error += "\"id\":" + String(currentRequestId) + ",";
+        error += "\"status\":\"error\",\"message\":\"Reply too long\",\"length\":" + String(reply.length()) + "}";
+        send(error.c_str());
+    }
+
+    // Reply to the current command, tagged with its request ID if it had one.
+    // JSON objects get the id spliced in; plain-text replies are wrapped.
+    void notify(const char *value)
+    {
+        replied = true;
+        if (currentRequestId == NO_REQUEST_ID)
+        {
+            sendReply(value);
+            return;
+        }
+
+        String tagged = "{\"id\":" + String(currentRequestId);
+        if (value[0] == '{')
+        {
+            if (value[1] != '}')
+                tagged += ",";
+            tagged += value + 1;
+        }
+        else
+        {
+            tagged += ",\"result\":\"";
+            for (const char *c = value; *c; c++)
             {
-                for (char c : rxValue)
-                {
-                    if (c == '\n')
-                    {
-                        server.commandMutex.lock();
-                        server.commandQueue.push_back(QueuedCommand(server.incomingBuffer));
-                        server.commandMutex.unlock();
-                        server.incomingBuffer = "";
-                    }
-                    else
-                    {
-                        server.incomingBuffer += c;
-                    }
-                }
+                if (*c == '"' || *c == '\\')
+                    tagged += '\\';
+                tagged += *c;
             }
+            tagged += "\"}";
         }
-    };
+        sendReply(tagged);
+    }
 
-    void notify(const char *value)
+    void onLoggerEvent(const LoggerEvent &event)
+    {
+        if (subscription == SUB_NONE)
+            return;
+
+        if (event.type == LOGGER_BACKPRESSURE)
+        {
+            // Near full, every append sheds; one push per pass is plenty
+            std::lock_guard<std::mutex> lock(pushMutex);
+            shedSincePush += event.shed;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(pushMutex);
+        if (event.type == LOGGER_RECORD_ADDED)
+        {
+            pushQueue.push_back(event);
+        }
+        else if (queuedWatermarks < MAX_PENDING_PUSHES)
+        {
+            pushQueue.push_back(event);
+            queuedWatermarks++;
+        }
+        if (event.type == LOGGER_WATERMARK && subscription == SUB_STREAM)
+            streamRequested = true;
+    }
+
+    static String pushToJson(const LoggerEvent &event)
     {
-        if (deviceConnected)
+        String push;
+        if (event.type == LOGGER_RECORD_ADDED)
+        {
+            push = "{\"event\":\"" + String(event.record.type == SIP ? "sip" : "refill") +
+                   "\",\"seq\":" + String(event.record.seq) +
+                   ",\"start_time\":" + eventTimeToJson(event.record.startTime()) +
+                   ",\"end_time\":" + eventTimeToJson(event.record.endTime()) +
+                   ",\"grams\":" + String(event.record.grams, 2);
+        }
+        else
         {
-            pTxCharacteristic->setValue(value);
-            pTxCharacteristic->notify();
+            push = "{\"event\":\"watermark\",\"level\":" + String(event.level);
         }
+        push += ",\"bufferSize\":" + String(event.size) + "}";
+        return push;
+    }
+
+    // Sends up to MAX_PUSHES_PER_PASS queued pushes, then at most one page of
+    // an active export stream so commands are never starved by a long
+    // export. Whatever the link does not take stays queued for the next
+    // pass, so a burst costs latency, not pushes.
+    void processPushes()
+    {
+        if (!transport.isConnected())
+        {
+            // Nobody to send to, and the next client has not subscribed
+            std::lock_guard<std::mutex> lock(pushMutex);
+            pushQueue.clear();
+            queuedWatermarks = 0;
+            shedSincePush = 0;
+            streamRequested = false;
+            streaming = false;
+            return;
+        }
+
+        for (int i = 0; i < MAX_PUSHES_PER_PASS; i++)
+        {
+            // Only this task pops, so the front stays put while it is sent
+            LoggerEvent event;
+            {
+                std::lock_guard<std::mutex> lock(pushMutex);
+                if (pushQueue.empty())
+                    break;
+                event = pushQueue.front();
+            }
+            if (!send(pushToJson(event).c_str()))
+                return;
+            std::lock_guard<std::mutex> lock(pushMutex);
+            if (event.type == LOGGER_WATERMARK)
+                queuedWatermarks--;
+            pushQueue.pop_front();
+        }
+
+        size_t shed;
+        {
+            std::lock_guard<std::mutex> lock(pushMutex);
+            if (!pushQueue.empty())
+                return; // the rest first, so a subscriber sees them in order
+            shed = shedSincePush;
+            shedSincePush = 0;
+            if (streamRequested && !streaming)
+            {
+                streaming = true;
+                getDataLogger().getSeqRange(&streamFrom, &streamStop);
+                streamNext = streamFrom;
+            }
+            streamRequested = false;
+        }
+        if (shed > 0)
+        {
+            String push = "{\"event\":\"backpressure\",\"shed\":" + String(shed) +
+                          ",\"dropped\":" + String(getDataLogger().getDroppedRecords()) +
+                          ",\"bufferSize\":" + String(getDataLogger().getBufferSize()) + "}";
+            if (!send(push.c_str()))
+            {
+                std::lock_guard<std::mutex> lock(pushMutex);
+                shedSincePush += shed;
+                return;
+            }
+        }
+        if (!streaming)
+            return;
+
+        if (subscription != SUB_STREAM || streamNext >= streamStop)
+        {
+            // Pages cover [from, next) back to back; the client drops up to
+            // where its own copy stops being contiguous
+            String done = "{\"event\":\"streamEnd\",\"from\":" + String(streamFrom) +
+                          ",\"next\":" + String(streamNext) + "}";
+            if (send(done.c_str()))
+                streaming = false;
+            return;
+        }
+
+        size_t maxPayload = transport.getMaxPayload();
+        size_t prefix = strlen(STREAM_PAGE_PREFIX) - 1;
+        uint32_t next;
+        String page = getDataLogger().getRangeJson(streamNext, streamStop - streamNext,
+                                                   maxPayload > prefix ? maxPayload - prefix : 0, &next);
+        if (next == streamNext)
+        {
+            // Not even one record fits a notification; end here
+            streamStop = streamNext;
+            return;
+        }
+        if (send((STREAM_PAGE_PREFIX + page.substring(1)).c_str()))
+            streamNext = next;
+    }
+
+    void replyWithId(long requestId, const char *value)
+    {
+        currentRequestId = requestId;
+        notify(value);
+        currentRequestId = NO_REQUEST_ID;
     }
 
     void handleCommand(const String &cmd)
@@ -100,12 +357,20 @@ private:
         }
         else if (command == "setTime")
         {
-            time_t targetTime = args.toInt();
+            // setTime <epoch seconds>[.fraction]; each call is one sample for
+            // the clock's offset/skew estimate
+            EventTime targetTime = parseEventTime(args);
             if (targetTime > 0)
             {
-                getDataLogger().setTimeOffset(targetTime - time(nullptr));
-                String response = "{\"status\":\"ok\",\"offset\":" +
-                                  String(getDataLogger().getTimeOffset()) +
+                // The client's timestamp is from when the command arrived, not
+                // from when it got out of the queue
+                targetTime += millis() - currentCommandReceived;
+                getDataLogger().syncClock(targetTime);
+                EventClock clock = getDataLogger().getClock();
+                String response = "{\"status\":\"ok\",\"offsetMs\":" +
+                                  String((long long)clock.getOffsetMs()) +
+                                  ",\"skewPpm\":" + String(clock.getSkewPpm(), 1) +
+                                  ",\"samples\":" + String(clock.getSampleCount()) +
                                   ",\"time\":\"" + getDataLogger().getTimestamp() + "\"}";
                 notify(response.c_str());
             }
@@ -142,7 +407,42 @@ private:
             }
 
             Serial.printf("Reading buffer: offset=%d length=%d\n", offset, length);
-            notify(getDataLogger().getBufferJsonPaginated(offset, length).c_str());
+            notify(getDataLogger().getBufferJsonPaginated(offset, length, replyBudget()).c_str());
+        }
+        else if (command == "readRange")
+        {
+            // readRange <fromSeq> [count]: records by seq, the range may come
+            // back short to fit a notification (then "next" < fromSeq + count)
+            unsigned long fromSeq = 0, count = pageRecords();
+            if (sscanf(args.c_str(), "%lu %lu", &fromSeq, &count) < 1)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Invalid format\"}");
+                return;
+            }
+            uint32_t first, end, next;
+            getDataLogger().getSeqRange(&first, &end);
+            String page = getDataLogger().getRangeJson(fromSeq, count, replyBudget(), &next);
+            if (next == fromSeq && fromSeq < end && count > 0)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Reply too long\"}");
+                return;
+            }
+            notify(page.c_str());
+        }
+        else if (command == "dropBefore")
+        {
+            // dropBefore <seq>: drops everything older, safe to retry
+            if (args.isEmpty())
+            {
+                notify("{\"status\":\"error\",\"message\":\"Invalid format\"}");
+                return;
+            }
+            size_t dropped = getDataLogger().dropBefore(strtoul(args.c_str(), nullptr, 10));
+            uint32_t first, next;
+            getDataLogger().getSeqRange(&first, &next);
+            String response = "{\"status\":\"ok\",\"dropped\":" + String(dropped) +
+                              ",\"firstSeq\":" + String(first) + "}";
+            notify(response.c_str());
         }
         else if (command == "startLogging")
         {
@@ -157,6 +457,7 @@ private:
         else if (command == "getNow")
         {
             String response = "{\"epoch\":" + String(getDataLogger().getCorrectedTime()) +
+                              ",\"epochMs\":" + String((long long)getDataLogger().now()) +
                               ",\"local\":\"" + getDataLogger().getTimestamp() + "\"}";
             notify(response.c_str());
         }
@@ -165,18 +466,69 @@ private:
             String status = "{";
             status += "\"logging\":" + String(getDataLogger().isLoggingEnabled() ? "true" : "false");
             status += ",\"bufferSize\":" + String(getDataLogger().getBufferSize());
-            status += ",\"rateHz\":" + String(samplingRateHz);
+            status += ",\"rateHz\":" + String(samplingRateHz.load());
+            status += ",\"window\":" + String(PIPELINE_WINDOW);
+            status += ",\"maxPayload\":" + String(transport.getMaxPayload());
+            status += ",\"capacity\":" + String(getDataLogger().getCapacity());
+            status += ",\"dropped\":" + String(getDataLogger().getDroppedRecords());
+            uint32_t firstSeq, nextSeq;
+            getDataLogger().getSeqRange(&firstSeq, &nextSeq);
+            status += ",\"firstSeq\":" + String(firstSeq);
+            status += ",\"nextSeq\":" + String(nextSeq);
+            status += ",\"page\":" + String(pageRecords());
+            status += ",\"subscription\":\"" + String(subscription == SUB_STREAM ? "stream" : subscription == SUB_EVENTS ? "events"
+                                                                                                                         : "none") +
+                      "\"";
             status += "}";
             notify(status.c_str());
         }
+        else if (command == "getStats")
+        {
+            // Sampling, capture and boot diagnostics; kept out of getStatus so
+            // each fits a notification at the MTUs phones negotiate
+            SamplingCounters sampling = getSamplingStats().snapshot();
+            String stats = "{";
+            stats += "\"maxGapUs\":" + String(sampling.maxGapUs);
+            stats += ",\"meanGapUs\":" + String(sampling.meanGapUs());
+            stats += ",\"maxDetectUs\":" + String(sampling.maxDetectUs);
+            stats += ",\"meanDetectUs\":" + String(sampling.meanDetectUs());
+            stats += ",\"rejected\":" + String(sampling.rejectedSamples);
+            stats += ",\"capture\":\"" + String(getCaptureStateStr(getRawCapture().getState())) + "\"";
+            stats += ",\"captured\":" + String(getRawCapture().size());
+            stats += ",\"warmBoot\":" + String(getBootStats().warmBoot ? "true" : "false");
+            stats += ",\"bootMs\":" + String((long)(getBootStats().firstSampleUs / 1000));
+            stats += "}";
+            notify(stats.c_str());
+        }
+        else if (command == "getCompression")
+        {
+            SwingDoor compressor = getDataLogger().getCompressor();
+            String response = "{\"mode\":\"" + String(getCompressionModeStr(compressor.getMode())) + "\"";
+            response += ",\"error\":" + String(compressor.getError(), 2);
+            response += ",\"inputs\":" + String(compressor.getInputs());
+            response += ",\"outputs\":" + String(compressor.getOutputs());
+            response += ",\"ratio\":" + String(compressor.getRatio(), 1);
+            response += "}";
+            notify(response.c_str());
+        }
         else if (command == "setSamplingRate")
         {
+            // setSamplingRate <Hz>: the loop waits 1000 / Hz ms after each
+            // read, so the HX711's own conversion time comes on top. The
+            // detector's windows are in samples and stretch with the period.
             int rate = args.toInt();
-            if (rate > 0)
+            if (rate > 0 && rate <= MAX_SAMPLING_RATE_HZ)
             {
                 samplingRateHz = rate;
                 Serial.print("Sampling rate set to ");
                 Serial.println(rate);
+                String response = "{\"status\":\"ok\",\"rateHz\":" + String(rate) +
+                                  ",\"periodMs\":" + String(1000 / rate) + "}";
+                notify(response.c_str());
+            }
+            else
+            {
+                notify("{\"status\":\"error\",\"message\":\"Invalid rate\"}");
             }
         }
         else if (command == "calibrate")
@@ -185,12 +537,15 @@ private:
             int parsed = sscanf(args.c_str(), "%d %d %d", &a, &b, &c);
             if (parsed == 3)
             {
-                Serial.printf("Calibration set: low=%d, high=%d, weight=%d\n", a, b, c);
-                // TODO: store these and use for grams conversion
+                // TODO: store these and use for grams conversion; until then
+                // say so rather than ack a calibration that changed nothing
+                Serial.printf("Calibration not stored: low=%d, high=%d, weight=%d\n", a, b, c);
+                notify("{\"status\":\"error\",\"message\":\"Not implemented\"}");
             }
             else
             {
                 Serial.println("Invalid calibration args");
+                notify("{\"status\":\"error\",\"message\":\"Invalid calibration args\"}");
             }
         }
         else if (command == "reset")
@@ -198,6 +553,17 @@ private:
             Serial.println("Resetting...");
             ESP.restart();
         }
+        else if (command == "coldReset")
+        {
+            // Drop the warm-restart checkpoint so the next boot re-tares. The
+            // sampling loop checkpoints from the other core; give it a sample
+            // period (the slowest one seen, if the HX711 is the bottleneck)
+            // to finish the one it may be in.
+            Serial.println("Resetting (cold)...");
+            uint32_t periodMs = max((uint32_t)(1000 / samplingRateHz.load()), getSamplingStats().snapshot().maxGapUs / 1000);
+            getWarmRestart().invalidate(periodMs + 10);
+            ESP.restart();
+        }
         else if (command == "setLogLevel")
         {
             int spaceIdx2 = args.indexOf(' ');
@@ -251,59 +617,349 @@ private:
                               ",\"length\":" + String(length) + "}";
             notify(response.c_str());
         }
+        else if (command == "setCompression")
+        {
+            // setCompression <off|constant|linear> [errorGrams]
+            int spaceIdx2 = args.indexOf(' ');
+            String modeName = (spaceIdx2 == -1) ? args : args.substring(0, spaceIdx2);
+            float error = (spaceIdx2 == -1) ? DEFAULT_COMPRESSION_ERROR : args.substring(spaceIdx2 + 1).toFloat();
+
+            CompressionMode mode;
+            if (modeName == "off")
+                mode = COMPRESSION_OFF;
+            else if (modeName == "constant")
+                mode = COMPRESSION_CONSTANT;
+            else if (modeName == "linear")
+                mode = COMPRESSION_LINEAR;
+            else
+            {
+                notify("{\"status\":\"error\",\"message\":\"Unknown mode\"}");
+                return;
+            }
+            if (error <= 0)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Invalid error bound\"}");
+                return;
+            }
+
+            getDataLogger().setCompression(mode, error);
+            String response = "{\"status\":\"ok\",\"mode\":\"" + modeName +
+                              "\",\"error\":" + String(error, 2) + "}";
+            notify(response.c_str());
+        }
+        else if (command == "flushMeasurements")
+        {
+            getDataLogger().flushMeasurements();
+            notify("{\"status\":\"ok\"}");
+        }
+        else if (command == "captureRaw")
+        {
+            // captureRaw <seconds> [rate]; no rate = every sensor reading
+            float seconds = 0, rate = 0;
+            int parsed = sscanf(args.c_str(), "%f %f", &seconds, &rate);
+            if (parsed < 1 || seconds <= 0 || rate < 0)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Invalid format\"}");
+                return;
+            }
+            if (!getRawCapture().start(seconds, rate))
+            {
+                notify("{\"status\":\"error\",\"message\":\"Capture already running\"}");
+                return;
+            }
+            String response = "{\"status\":\"ok\",\"capacity\":" + String(RAW_CAPTURE_CAPACITY) + "}";
+            notify(response.c_str());
+        }
+        else if (command == "captureStop")
+        {
+            getRawCapture().stop();
+            notify("{\"status\":\"ok\"}");
+        }
+        else if (command == "readCapture")
+        {
+            // readCapture [offset] [length]; times are us since capture start.
+            // The page stops short of length when no more samples fit one
+            // notification, so read on from offset + the "length" returned.
+            unsigned long offset = 0, length = RAW_CAPTURE_CAPACITY;
+            sscanf(args.c_str(), "%lu %lu", &offset, &length);
+
+            RawCapture &capture = getRawCapture();
+            uint32_t total = capture.size();
+            uint32_t available = total > offset ? total - offset : 0;
+            uint32_t maxLength = min((uint32_t)length, available);
+
+            String json = "{\"state\":\"" + String(getCaptureStateStr(capture.getState())) + "\"";
+            json += ",\"total\":" + String(total);
+            json += ",\"offset\":" + String(offset);
+            json += ",\"tareOffset\":" + String(capture.getTareOffset());
+            // ,"length":n and ,"t":[],"raw":[]}
+            size_t envelope = json.length() + 10 + String(maxLength).length() + 17;
+
+            String times, counts;
+            uint32_t actualLength = 0;
+            for (; actualLength < maxLength; actualLength++)
+            {
+                String t = String(capture.getTimeUs(offset + actualLength));
+                String raw = String(capture.getCount(offset + actualLength));
+                if (envelope + times.length() + counts.length() + t.length() + raw.length() + 2 > replyBudget())
+                    break;
+                if (actualLength > 0)
+                {
+                    times += ",";
+                    counts += ",";
+                }
+                times += t;
+                counts += raw;
+            }
+
+            if (actualLength == 0 && maxLength > 0)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Reply too long\"}");
+                return;
+            }
+            json += ",\"length\":" + String(actualLength);
+            json += ",\"t\":[" + times + "],\"raw\":[" + counts + "]}";
+            notify(json.c_str());
+        }
+        else if (command == "resetStats")
+        {
+            getSamplingStats().requestReset();
+            notify("{\"status\":\"ok\"}");
+        }
+        else if (command == "subscribe")
+        {
+            // subscribe [events|stream]
+            if (args.isEmpty() || args == "events")
+            {
+                subscription = SUB_EVENTS;
+            }
+            else if (args == "stream")
+            {
+                subscription = SUB_STREAM;
+                // Watermarks crossed before this fired for nobody and stay
+                // spent until the buffer drains, so look at the fill now
+                if (getDataLogger().isAboveWatermark())
+                {
+                    std::lock_guard<std::mutex> lock(pushMutex);
+                    streamRequested = true;
+                }
+            }
+            else
+            {
+                notify("{\"status\":\"error\",\"message\":\"Unknown subscription\"}");
+                return;
+            }
+            String response = "{\"status\":\"ok\",\"subscription\":\"" +
+                              String(subscription == SUB_STREAM ? "stream" : "events") + "\"}";
+            notify(response.c_str());
+        }
+        else if (command == "unsubscribe")
+        {
+            subscription = SUB_NONE;
+            notify("{\"status\":\"ok\"}");
+        }
+        else if (command == "setWatermarks")
+        {
+            // setWatermarks <percent> [percent ...]
+            int levels[MAX_WATERMARKS];
+            int count = sscanf(args.c_str(), "%d %d %d %d", &levels[0], &levels[1], &levels[2], &levels[3]);
+            if (count <= 0)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Invalid format\"}");
+                return;
+            }
+            getDataLogger().setWatermarks(levels, count);
+
+            String response = "{\"status\":\"ok\",\"watermarks\":[";
+            for (int i = 0; i < getDataLogger().getWatermarkCount(); i++)
+            {
+                if (i > 0)
+                    response += ",";
+                response += String(getDataLogger().getWatermark(i));
+            }
+            response += "]}";
+            notify(response.c_str());
+        }
+        else if (command == "evalAdd")
+        {
+            // evalAdd <emaAlpha> <stabilityTolerance> <stabilityWindow> <zeroThreshold> <changeThreshold>
+            //         [<medianWindow> [<outlierSigmas>]]
+            // Left out = the live detector's (DEFAULT_DETECTOR_PARAMS)
+            DetectorParams p = DEFAULT_DETECTOR_PARAMS;
+            int parsed = sscanf(args.c_str(), "%f %f %d %f %f %d %f",
+                                &p.emaAlpha, &p.stabilityTolerance, &p.stabilityWindow,
+                                &p.zeroThreshold, &p.changeThreshold,
+                                &p.medianWindow, &p.outlierSigmas);
+            if (parsed < 5)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Invalid format\"}");
+                return;
+            }
+
+            int slot = getDetectorBank().add(p);
+            if (slot < 0)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Evaluation bank full\"}");
+                return;
+            }
+            String response = "{\"status\":\"ok\",\"set\":" + String(slot) + "}";
+            notify(response.c_str());
+        }
+        else if (command == "evalClear")
+        {
+            getDetectorBank().clear();
+            notify("{\"status\":\"ok\"}");
+        }
+        else if (command == "evalReset")
+        {
+            getDetectorBank().resetTallies();
+            notify("{\"status\":\"ok\"}");
+        }
+        else if (command == "evalReport")
+        {
+            // evalReport [first]; as many sets as fit one notification, the
+            // client asks again from "next" until it reaches "count"
+            DetectorBank &bank = getDetectorBank();
+            int first = args.isEmpty() ? 0 : max(0, (int)args.toInt());
+            int count = bank.size();
+            String sets;
+            int next = first;
+            for (; next < count; next++)
+            {
+                const DetectorParams &p = bank.getDetector(next).getParams();
+                DetectorTally t = bank.getTally(next);
+                String set = "{\"set\":" + String(next) +
+                             ",\"alpha\":" + String(p.emaAlpha, 2) +
+                             ",\"tol\":" + String(p.stabilityTolerance, 2) +
+                             ",\"window\":" + String(p.stabilityWindow) +
+                             ",\"zero\":" + String(p.zeroThreshold, 2) +
+                             ",\"change\":" + String(p.changeThreshold, 2) +
+                             ",\"median\":" + String(p.medianWindow) +
+                             ",\"sigmas\":" + String(p.outlierSigmas, 1) +
+                             ",\"sips\":" + String(t.sips) +
+                             ",\"sipGrams\":" + String(t.sipGrams, 1) +
+                             ",\"refills\":" + String(t.refills) +
+                             ",\"refillGrams\":" + String(t.refillGrams, 1) +
+                             ",\"noops\":" + String(t.noops) +
+                             ",\"rejected\":" + String(t.rejected) + "}";
+                // The envelope below is 37 bytes plus three numbers <= count
+                if (37 + 3 * String(count).length() + sets.length() + 1 + set.length() > replyBudget())
+                    break;
+                if (!sets.isEmpty())
+                    sets += ",";
+                sets += set;
+            }
+            if (next == first && first < count)
+            {
+                notify("{\"status\":\"error\",\"message\":\"Reply too long\"}");
+                return;
+            }
+            String report = "{\"count\":" + String(count) +
+                            ",\"first\":" + String(first) +
+                            ",\"next\":" + String(next) +
+                            ",\"sets\":[" + sets + "]}";
+            notify(report.c_str());
+        }
+        else if (command == "getCalibration")
+        {
+            // What the detectors convert with; bttest.py's capture writes it
+            // into the trace so the replay tools use the same numbers
+            Calibration cal = getDetectorBank().getCalibration();
+            String response = "{\"noLoad\":" + String(cal.noLoad, 1) +
+                              ",\"atLoad\":" + String(cal.atLoad, 1) +
+                              ",\"weight\":" + String(cal.weight, 1) + "}";
+            notify(response.c_str());
+        }
         else
         {
-            notify("Unknown command");
+            notify("{\"status\":\"error\",\"message\":\"Unknown command\"}");
+        }
+    }
+
+    static void commandTaskMain(void *arg)
+    {
+        BtServer *server = static_cast<BtServer *>(arg);
+        while (true)
+        {
+            // Woken by onWrite, or periodically for pushes and streams
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(COMMAND_TASK_POLL_MS));
+            server->processCommands();
         }
     }
 
 public:
-    BtServer(int &samplingRate) : samplingRateHz(samplingRate) {}
+    BtServer(Transport &t, std::atomic<int> &samplingRate) : transport(t), samplingRateHz(samplingRate)
+    {
+        transport.onReceive([this](const char *data, size_t length)
+                            { onReceive(data, length); });
+        transport.onConnectionChange([this](bool connected)
+                                     {
+                                         if (!connected)
+                                             subscription = SUB_NONE;
+                                     });
+        getDataLogger().setListener([this](const LoggerEvent &event)
+                                    { onLoggerEvent(event); });
+    }
 
     void setup()
     {
-        BLEDevice::init("ESP32-Scale");
-        pServer = BLEDevice::createServer();
-        pServer->setCallbacks(new ServerCallbacks(*this));
-
-        BLEService *pService = pServer->createService(SERVICE_UUID);
-
-        pTxCharacteristic = pService->createCharacteristic(
-            CHARACTERISTIC_TX,
-            BLECharacteristic::PROPERTY_NOTIFY);
-        pTxCharacteristic->addDescriptor(new BLE2902());
-
-        BLECharacteristic *pRxCharacteristic = pService->createCharacteristic(
-            CHARACTERISTIC_RX,
-            BLECharacteristic::PROPERTY_WRITE);
-        pRxCharacteristic->setCallbacks(new CharCallbacks(*this));
+        transport.begin();
+    }
 
-        pService->start();
-        pServer->getAdvertising()->start();
-        Serial.println("BLE UART started, waiting for connections...");
+    // Takes command handling (and all JSON serialization) off the sampling loop
+    void startCommandTask()
+    {
+        xTaskCreatePinnedToCore(commandTaskMain, "commands", COMMAND_TASK_STACK, this, 1,
+                                &commandTask, COMMAND_TASK_CORE);
     }
 
     void processCommands()
     {
-        while (!commandQueue.empty())
+        while (true)
         {
             commandMutex.lock();
+            if (commandQueue.empty())
+            {
+                commandMutex.unlock();
+                break;
+            }
             QueuedCommand cmd = commandQueue.front();
             commandQueue.pop_front();
             commandMutex.unlock();
 
-            if (millis() - cmd.timestamp > 1000)
+            if (millis() - cmd.timestamp > COMMAND_EXPIRY_MS)
             {
                 Serial.println("Warning: Dropped old command");
+                if (cmd.requestId != NO_REQUEST_ID)
+                    replyWithId(cmd.requestId, "{\"status\":\"error\",\"message\":\"Expired\"}");
                 continue;
             }
 
+            if (cmd.overflow && cmd.requestId != NO_REQUEST_ID)
+            {
+                Serial.println("Warning: Pipeline window full");
+                replyWithId(cmd.requestId, "{\"status\":\"busy\"}");
+                continue;
+            }
+
+            currentRequestId = cmd.requestId;
+            currentCommandReceived = cmd.timestamp;
+            replied = false;
             handleCommand(cmd.command);
+
+            // Pipelined clients need to hear back from every command, even
+            // the ones that are silent without an ID
+            if (currentRequestId != NO_REQUEST_ID && !replied)
+                notify("{\"status\":\"ok\"}");
+            currentRequestId = NO_REQUEST_ID;
+
             vTaskDelay(1); // Yield to BLE stack
         }
+
+        processPushes();
     }
 
-    bool isConnected() const { return deviceConnected; }
+    bool isConnected() const { return transport.isConnected(); }
 };
 
 // Global instance
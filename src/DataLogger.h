@@ -1,7 +1,27 @@
 #pragma once
 #include <deque>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
 #include <time.h>
 #include <Arduino.h>
+#include "EventClock.h"
+#include "SwingDoor.h"
+
+#define RECORD_CAPACITY 512     // hard cap on buffered records
+#define MAX_WATERMARKS 4
+#define BACKPRESSURE_PERCENT 90 // start shedding measurements at this fill level
+#define MAX_PENDING_EVENTS (SWING_DOOR_MAX_OUTPUT * (MAX_WATERMARKS + 2))
+
+// Longest recordToJson() with realistic values, and getRangeJson()'s envelope
+// with every number at its longest: what a page of n records needs at most
+#define RECORD_JSON_MAX 111
+#define RANGE_JSON_ENVELOPE 63
+
+#define DEFAULT_COMPRESSION COMPRESSION_LINEAR
+#define DEFAULT_COMPRESSION_ERROR 0.5f // grams
 
 enum RecordType
 {
@@ -10,63 +30,494 @@ enum RecordType
     REFILL
 };
 
+#define RECORD_OPEN 0x01   // measurement not stabilized yet, no end time
+#define RECORD_VERTEX 0x02 // swing-door vertex: interpolate to the next one
+
+// Compact 20-byte record: whole seconds plus a millisecond part for the start,
+// and the end stored as a duration. Use the helpers rather than the fields.
+//
+// seq numbers every record ever appended, in order and never reused, so a
+// client can read and drop by seq while back-pressure sheds records from the
+// middle of the buffer and shifts every index behind them.
 struct Record
 {
-    time_t start_time;
-    time_t end_time; // 0 if not stabilized
+    uint32_t start_s;     // epoch seconds
+    uint16_t start_ms;    // 0..999
+    uint8_t type;         // RecordType
+    uint8_t flags;        // RECORD_*
+    uint32_t duration_ms; // end - start
     float grams;
-    RecordType type;
+    uint32_t seq;         // assigned by DataLogger on append
+
+    static Record make(EventTime start, EventTime end, float grams, RecordType type)
+    {
+        Record r;
+        r.start_s = (uint32_t)(start / 1000);
+        r.start_ms = (uint16_t)(start % 1000);
+        r.type = type;
+        r.flags = end == 0 ? RECORD_OPEN : 0;
+        r.duration_ms = end > start ? (uint32_t)(end - start) : 0;
+        r.grams = grams;
+        r.seq = 0;
+        return r;
+    }
+
+    EventTime startTime() const { return (EventTime)start_s * 1000 + start_ms; }
+    EventTime endTime() const { return (flags & RECORD_OPEN) ? 0 : startTime() + duration_ms; }
+    RecordType getType() const { return (RecordType)type; }
+    bool isOpen() const { return flags & RECORD_OPEN; }
+
+    void setEnd(EventTime end)
+    {
+        duration_ms = end > startTime() ? (uint32_t)(end - startTime()) : 0;
+        flags &= ~RECORD_OPEN;
+    }
 };
 
+// Epoch ms as fractional seconds, so existing clients keep reading seconds
+inline String eventTimeToJson(EventTime t)
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%lld.%03d", (long long)(t / 1000), (int)(t % 1000));
+    return String(buf);
+}
+
+enum LoggerEventType
+{
+    LOGGER_RECORD_ADDED, // a sip or refill was logged
+    LOGGER_WATERMARK,    // fill level rose past a watermark
+    LOGGER_BACKPRESSURE  // records had to be shed to make room
+};
+
+struct LoggerEvent
+{
+    LoggerEventType type;
+    Record record;        // LOGGER_RECORD_ADDED only
+    int level;            // LOGGER_WATERMARK: the percentage crossed
+    size_t size;          // buffer size after the change
+    size_t shed;          // LOGGER_BACKPRESSURE: records removed
+};
+
+typedef std::function<void(const LoggerEvent &)> LoggerListener;
+
+// Records are appended by the sampling loop and read by the command task.
+// Readers never walk the live deque: they copy the page they need under the
+// lock (copy-on-read) and serialize the copy afterwards, so a long export only
+// ever holds the lock for a memcpy-sized moment and appends are not blocked
+// behind JSON formatting. Listener events are collected under the lock and
+// dispatched after it is released.
 class DataLogger
 {
 private:
+    struct PendingEvents
+    {
+        LoggerEvent items[MAX_PENDING_EVENTS];
+        int count = 0;
+    };
+
+    mutable std::mutex bufferMutex; // guards everything below but the atomics
+    mutable std::mutex clockMutex;  // guards clock
+
     std::deque<Record> recordBuffer;
-    bool loggingEnabled;
-    time_t timeOffset; // Moved from main.cpp
+    std::atomic<bool> loggingEnabled; // checked without the lock first
+    EventClock clock; // Moved from main.cpp
+    std::atomic<uint32_t> generation{0}; // bumped on every buffer change
+    uint32_t nextSeq = 0;                 // seq of the next record appended
+    SwingDoor compressor;    // measurement series -> segments
+
+    LoggerListener listener;
+    int watermarks[MAX_WATERMARKS] = {50, 75};
+    int watermarkCount = 2;
+    uint32_t armedWatermarks = ~0u; // bit i set = watermark i may fire again
+    size_t droppedRecords = 0;      // lost to a full buffer, not just shed
+
+    static void emit(PendingEvents &events, const LoggerEvent &event)
+    {
+        if (events.count < MAX_PENDING_EVENTS)
+            events.items[events.count++] = event;
+    }
+
+    // Call without bufferMutex held
+    void dispatch(const PendingEvents &events)
+    {
+        if (!listener)
+            return;
+        for (int i = 0; i < events.count; i++)
+            listener(events.items[i]);
+    }
+
+    // Fires each watermark once on the way up, re-arms it once the buffer
+    // drains below it again. bufferMutex held.
+    void checkWatermarks(PendingEvents *events)
+    {
+        size_t fill = recordBuffer.size() * 100 / RECORD_CAPACITY;
+        for (int i = 0; i < watermarkCount; i++)
+        {
+            uint32_t bit = 1u << i;
+            if (fill < (size_t)watermarks[i])
+            {
+                armedWatermarks |= bit;
+            }
+            else if (armedWatermarks & bit)
+            {
+                armedWatermarks &= ~bit;
+                if (events)
+                    emit(*events, {LOGGER_WATERMARK, {}, watermarks[i], recordBuffer.size(), 0});
+            }
+        }
+    }
+
+    // Near the top, raw measurements are the cheapest thing to give up; sips
+    // and refills are only lost if the buffer is full of nothing else.
+    // bufferMutex held.
+    void applyBackPressure(PendingEvents &events)
+    {
+        size_t shed = 0;
+        if (recordBuffer.size() * 100 >= (size_t)RECORD_CAPACITY * BACKPRESSURE_PERCENT)
+        {
+            for (auto it = recordBuffer.begin(); it != recordBuffer.end() &&
+                                                 recordBuffer.size() * 100 >= (size_t)RECORD_CAPACITY * BACKPRESSURE_PERCENT;)
+            {
+                if (it->getType() == MEASUREMENT && it + 1 != recordBuffer.end())
+                {
+                    it = recordBuffer.erase(it);
+                    shed++;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+        while (recordBuffer.size() > RECORD_CAPACITY)
+        {
+            recordBuffer.pop_front();
+            droppedRecords++;
+            shed++;
+        }
+        if (shed > 0)
+            emit(events, {LOGGER_BACKPRESSURE, {}, 0, recordBuffer.size(), shed});
+    }
+
+    // Index of the first record with a seq >= `seq`. bufferMutex held.
+    size_t indexOfSeq(uint32_t seq) const
+    {
+        return std::lower_bound(recordBuffer.begin(), recordBuffer.end(), seq,
+                                [](const Record &r, uint32_t s)
+                                { return r.seq < s; }) -
+               recordBuffer.begin();
+    }
 
     // Helper method to serialize a single record
     String recordToJson(const Record &r) const
     {
-        return "{\"start_time\":" + String(r.start_time) +
-               ",\"end_time\":" + String(r.end_time) +
+        return "{\"seq\":" + String(r.seq) +
+               ",\"start_time\":" + eventTimeToJson(r.startTime()) +
+               ",\"end_time\":" + eventTimeToJson(r.endTime()) +
                ",\"grams\":" + String(r.grams, 2) +
                ",\"type\":\"" + String(r.type == SIP ? "sip" : r.type == REFILL ? "refill"
+                                                  : (r.flags & RECORD_VERTEX) ? "vertex"
                                                                                 : "measurement") +
                "\"}";
     }
 
+    // bufferMutex held
+    void appendSegments(const Segment *segments, int count, PendingEvents &events)
+    {
+        CompressionMode mode = compressor.getMode();
+        for (int i = 0; i < count; i++)
+        {
+            Record r = Record::make(segments[i].start, segments[i].end, segments[i].value, MEASUREMENT);
+            if (mode == COMPRESSION_LINEAR)
+                r.flags |= RECORD_VERTEX;
+            appendLocked(r, events);
+        }
+    }
+
+    // Closes the open segment and starts a new series with the next sample,
+    // for when measurements stop following on from the last vertex (see
+    // SwingDoor::restart()). bufferMutex held.
+    void endSeriesLocked(PendingEvents &events)
+    {
+        Segment out[SWING_DOOR_MAX_OUTPUT];
+        appendSegments(out, compressor.flush(out), events);
+        compressor.restart();
+    }
+
+    // bufferMutex held
+    void appendLocked(const Record &record, PendingEvents &events)
+    {
+        recordBuffer.push_back(record);
+        recordBuffer.back().seq = nextSeq++;
+        generation++;
+
+        if (record.getType() != MEASUREMENT)
+            emit(events, {LOGGER_RECORD_ADDED, recordBuffer.back(), 0, recordBuffer.size(), 0});
+        applyBackPressure(events);
+        checkWatermarks(&events);
+    }
+
 public:
-    DataLogger() : loggingEnabled(true), timeOffset(0) {}
+    DataLogger() : loggingEnabled(true)
+    {
+        compressor.configure(DEFAULT_COMPRESSION, DEFAULT_COMPRESSION_ERROR);
+    }
 
     // Core buffer operations
-    void addRecord(time_t start_time, time_t end_time, float grams, RecordType type)
+    void addRecord(EventTime start_time, EventTime end_time, float grams, RecordType type)
     {
         if (!loggingEnabled)
             return;
-        recordBuffer.push_back({start_time, end_time, grams, type});
+
+        PendingEvents events;
+        {
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            appendLocked(Record::make(start_time, end_time, grams, type), events);
+        }
+        dispatch(events);
     }
 
+    // Also drops the open segment, so the next vertex is not anchored to a
+    // record that is gone
     void clearBuffer()
     {
+        std::lock_guard<std::mutex> lock(bufferMutex);
         recordBuffer.clear();
+        compressor.restart();
+        generation++;
+        checkWatermarks(nullptr);
+    }
+
+    // Put back records saved across a warm restart, bypassing loggingEnabled
+    void restoreRecords(const Record *records, size_t count)
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        recordBuffer.assign(records, records + count);
+        if (count > 0)
+            nextSeq = records[count - 1].seq + 1;
+        generation++;
+        checkWatermarks(nullptr);
+    }
+
+    // Snapshot of up to `max` records starting at `offset`; returns how many
+    // were copied. `total` (optional) gets the buffer size at that instant.
+    size_t copyRecords(size_t offset, size_t max, Record *out, size_t *total = nullptr) const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        size_t available = recordBuffer.size() > offset ? recordBuffer.size() - offset : 0;
+        size_t count = min(max, available);
+        for (size_t i = 0; i < count; i++)
+            out[i] = recordBuffer[offset + i];
+        if (total)
+            *total = recordBuffer.size();
+        return count;
+    }
+
+    // Snapshot of up to `max` records with a seq >= `fromSeq`; returns how
+    // many were copied. `end` gets the seq the next append will have.
+    size_t copyFromSeq(uint32_t fromSeq, size_t max, Record *out, uint32_t *end) const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        size_t first = indexOfSeq(fromSeq);
+        size_t count = min(max, recordBuffer.size() - first);
+        for (size_t i = 0; i < count; i++)
+            out[i] = recordBuffer[first + i];
+        *end = nextSeq;
+        return count;
+    }
+
+    // Snapshot of up to `max` records, oldest first, and the generation they
+    // belong to. Sips and refills are taken first (the newest, if there are
+    // more than `max`) and measurements only get the slots left over, so a
+    // long run of vertices cannot push an unsynced sip out of the copy.
+    size_t copyNewestEventsFirst(size_t max, Record *out, uint32_t *gen) const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        size_t events = 0;
+        for (const Record &r : recordBuffer)
+            events += r.getType() != MEASUREMENT;
+        size_t eventSlots = min(max, events);
+        size_t measurementSlots = min(max - eventSlots, recordBuffer.size() - events);
+
+        // Pick from the newest end, then put them back in buffer order
+        size_t count = 0;
+        for (auto it = recordBuffer.rbegin(); it != recordBuffer.rend() && eventSlots + measurementSlots > 0; ++it)
+        {
+            size_t &slots = it->getType() == MEASUREMENT ? measurementSlots : eventSlots;
+            if (slots == 0)
+                continue;
+            slots--;
+            out[count++] = *it;
+        }
+        std::reverse(out, out + count);
+        *gen = generation;
+        return count;
     }
 
+    // Events are raised from whichever task appends, so keep listeners short
+    void setListener(LoggerListener l) { listener = l; }
+
+    // Percentages of RECORD_CAPACITY, at most MAX_WATERMARKS of them
+    void setWatermarks(const int *levels, int count)
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        watermarkCount = min(count, MAX_WATERMARKS);
+        for (int i = 0; i < watermarkCount; i++)
+            watermarks[i] = levels[i];
+        armedWatermarks = ~0u;
+        checkWatermarks(nullptr);
+    }
+    int getWatermarkCount() const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        return watermarkCount;
+    }
+
+    // At or above the lowest watermark, whether or not it has fired
+    bool isAboveWatermark() const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        size_t fill = recordBuffer.size() * 100 / RECORD_CAPACITY;
+        for (int i = 0; i < watermarkCount; i++)
+        {
+            if (fill >= (size_t)watermarks[i])
+                return true;
+        }
+        return false;
+    }
+    int getWatermark(int i) const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        return watermarks[i];
+    }
+
+    size_t getCapacity() const { return RECORD_CAPACITY; }
+    size_t getDroppedRecords() const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        return droppedRecords;
+    }
+
+    // Lets checkpointing skip work when nothing changed. Read without the
+    // lock, so only good as a hint; copyNewestEventsFirst() returns the
+    // real value.
+    uint32_t getGeneration() const { return generation; }
+
     // Logging control
     bool isLoggingEnabled() const { return loggingEnabled; }
-    void setLoggingEnabled(bool enabled) { loggingEnabled = enabled; }
+    // Stopping ends the compressed series, so the first vertex after a
+    // restart is not interpolated across the gap
+    void setLoggingEnabled(bool enabled)
+    {
+        PendingEvents events;
+        {
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            if (!enabled)
+                endSeriesLocked(events);
+            loggingEnabled = enabled;
+        }
+        dispatch(events);
+    }
+
+    // Measurement compression. Switching modes closes the open segment first.
+    void setCompression(CompressionMode mode, float errorGrams)
+    {
+        PendingEvents events;
+        {
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            Segment out[SWING_DOOR_MAX_OUTPUT];
+            appendSegments(out, compressor.flush(out), events);
+            compressor.configure(mode, errorGrams);
+        }
+        dispatch(events);
+    }
+
+    // Closes the open segment so everything measured so far is in the buffer
+    void flushMeasurements()
+    {
+        PendingEvents events;
+        {
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            Segment out[SWING_DOOR_MAX_OUTPUT];
+            appendSegments(out, compressor.flush(out), events);
+        }
+        dispatch(events);
+    }
+
+    // Copy, for mode and ratio reporting
+    SwingDoor getCompressor() const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        return compressor;
+    }
 
     // Buffer access
-    const std::deque<Record> &getBuffer() const { return recordBuffer; }
-    size_t getBufferSize() const { return recordBuffer.size(); }
+    size_t getBufferSize() const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        return recordBuffer.size();
+    }
+
+    // seq of the oldest buffered record (== `next` when empty) and of the
+    // next one to be appended
+    void getSeqRange(uint32_t *first, uint32_t *next) const
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        *next = nextSeq;
+        *first = recordBuffer.empty() ? nextSeq : recordBuffer.front().seq;
+    }
 
     // Time management (moved from main.cpp)
-    void setTimeOffset(time_t offset) { timeOffset = offset; }
-    time_t getTimeOffset() const { return timeOffset; }
+    // A step back, or CLOCK_STEP_MS or more forward, also ends the
+    // compressed series (see SwingDoor::restart())
+    void syncClock(EventTime referenceMs)
+    {
+        EventTime before, after;
+        {
+            std::lock_guard<std::mutex> lock(clockMutex);
+            before = clock.now();
+            clock.sync(referenceMs);
+            after = clock.now();
+        }
+        if (after >= before && after - before < CLOCK_STEP_MS)
+            return;
+
+        PendingEvents events;
+        {
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            endSeriesLocked(events);
+        }
+        dispatch(events);
+    }
+
+    // Copy for reporting and checkpointing
+    EventClock getClock() const
+    {
+        std::lock_guard<std::mutex> lock(clockMutex);
+        return clock;
+    }
+
+    ClockModel getClockModel() const
+    {
+        std::lock_guard<std::mutex> lock(clockMutex);
+        return clock.getModel();
+    }
+
+    void setClockModel(const ClockModel &model)
+    {
+        std::lock_guard<std::mutex> lock(clockMutex);
+        clock.setModel(model);
+    }
+
+    EventTime now() const
+    {
+        std::lock_guard<std::mutex> lock(clockMutex);
+        return clock.now();
+    }
 
     time_t getCorrectedTime() const
     {
-        return time(nullptr) + timeOffset;
+        return now() / 1000;
     }
 
     String getTimestamp() const
@@ -85,80 +536,160 @@ public:
         if (!loggingEnabled)
             return;
 
-        time_t now = getCorrectedTime();
-        if (stable)
-        {
-            // If stable, update the last record's end time if it exists and matches
-            if (!recordBuffer.empty() &&
-                recordBuffer.back().end_time == 0 &&
-                abs(recordBuffer.back().grams - grams) < 1.0)
-            { // TODO: Make tolerance configurable
-                recordBuffer.back().end_time = now;
+        EventTime now = this->now();
+        PendingEvents events;
+        {
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            // Checked again under the lock: logging may have stopped (and
+            // ended the series) since
+            if (!loggingEnabled)
+                return;
+            if (compressor.getMode() != COMPRESSION_OFF)
+            {
+                // Only finished segments reach the buffer
+                Segment out[SWING_DOOR_MAX_OUTPUT];
+                appendSegments(out, compressor.add(now, grams, out), events);
+            }
+            else if (stable)
+            {
+                // If stable, update the last record's end time if it exists
+                // and is within the configured error
+                if (!recordBuffer.empty() &&
+                    recordBuffer.back().isOpen() &&
+                    fabsf(recordBuffer.back().grams - grams) <= compressor.getError())
+                {
+                    recordBuffer.back().setEnd(now);
+                    generation++;
+                }
+                else
+                {
+                    // New stable reading
+                    appendLocked(Record::make(now, now, grams, MEASUREMENT), events);
+                }
             }
             else
             {
-                // New stable reading
-                addRecord(now, now, grams, MEASUREMENT);
+                // Unstable reading, just record the start time
+                appendLocked(Record::make(now, 0, grams, MEASUREMENT), events);
             }
         }
-        else
-        {
-            // Unstable reading, just record the start time
-            addRecord(now, 0, grams, MEASUREMENT);
-        }
+        dispatch(events);
     }
 
-    void addSip(time_t start_time, float amount)
+    void addSip(EventTime start_time, float amount)
     {
         if (!loggingEnabled)
             return;
-        addRecord(start_time, getCorrectedTime(), amount, SIP);
+        addRecord(start_time, now(), amount, SIP);
     }
 
-    void addRefill(time_t start_time, float amount)
+    void addRefill(EventTime start_time, float amount)
     {
         if (!loggingEnabled)
             return;
-        addRecord(start_time, getCorrectedTime(), amount, REFILL);
+        addRecord(start_time, now(), amount, REFILL);
     }
 
-    // Get a paginated subset of records as JSON
-    String getBufferJsonPaginated(size_t offset, size_t length) const
+    // Get a paginated subset of records as JSON; the page ends early rather
+    // than grow past maxBytes, "length" says how many made it
+    String getBufferJsonPaginated(size_t offset, size_t length, size_t maxBytes = SIZE_MAX) const
     {
+        // Snapshot the page first; formatting happens without the lock
+        std::vector<Record> page(min(length, (size_t)RECORD_CAPACITY));
+        size_t total;
+        size_t copied = copyRecords(offset, page.size(), page.data(), &total);
+
+        // {"total":,"offset":,"length":,"records":[]} and its numbers
+        size_t envelope = 43 + String(total).length() + String(offset).length() + String(copied).length();
+        String records;
+        size_t actualLength = 0;
+        for (; actualLength < copied; actualLength++)
+        {
+            String record = recordToJson(page[actualLength]);
+            if (envelope + records.length() + 1 + record.length() > maxBytes)
+                break;
+            if (actualLength > 0)
+                records += ",";
+            records += record;
+        }
+
         String json = "{";
 
         // Add metadata
-        json += "\"total\":" + String(recordBuffer.size()) + ",";
+        json += "\"total\":" + String(total) + ",";
         json += "\"offset\":" + String(offset) + ",";
-
-        // Calculate actual length (handle bounds)
-        size_t available = recordBuffer.size() > offset ? recordBuffer.size() - offset : 0;
-        size_t actualLength = min(length, available);
         json += "\"length\":" + String(actualLength) + ",";
 
         // Add records array
-        json += "\"records\":[";
+        json += "\"records\":[" + records + "]}";
+        return json;
+    }
 
-        for (size_t i = 0; i < actualLength; i++)
+    // Records with fromSeq <= seq < fromSeq + count, as many as fit in
+    // maxBytes of JSON. `next` (also in the JSON) is where the following read
+    // starts: the end of the range if the page holds all of it, else the
+    // first record left out. It never passes the newest record, so dropping
+    // up to it cannot take anything appended after this read.
+    String getRangeJson(uint32_t fromSeq, size_t count, size_t maxBytes, uint32_t *next = nullptr) const
+    {
+        std::vector<Record> page(min(count, (size_t)RECORD_CAPACITY));
+        uint32_t end;
+        size_t copied = copyFromSeq(fromSeq, page.size(), page.data(), &end);
+        uint32_t stop = (uint32_t)min((uint64_t)fromSeq + count, (uint64_t)max(end, fromSeq));
+
+        // {"from":,"next":,"length":,"records":[]} and its numbers
+        size_t envelope = 40 + String(fromSeq).length() + String(stop).length() + String(copied).length();
+        String records;
+        size_t length = 0;
+        uint32_t resume = stop;
+        for (; length < copied && page[length].seq < stop; length++)
         {
-            if (i > 0)
-                json += ",";
-            json += recordToJson(recordBuffer[offset + i]);
+            String record = recordToJson(page[length]);
+            if (envelope + records.length() + 1 + record.length() > maxBytes)
+            {
+                resume = page[length].seq;
+                break;
+            }
+            if (length > 0)
+                records += ",";
+            records += record;
         }
+        if (next)
+            *next = resume;
 
-        json += "]}";
-        return json;
+        return "{\"from\":" + String(fromSeq) +
+               ",\"next\":" + String(resume) +
+               ",\"length\":" + String(length) +
+               ",\"records\":[" + records + "]}";
     }
 
     // Simplified version that gets all records
     String getBufferJson() const
     {
-        return getBufferJsonPaginated(0, recordBuffer.size());
+        return getBufferJsonPaginated(0, RECORD_CAPACITY);
+    }
+
+    // Drops every record with a seq below `seq`; returns how many. Safe to
+    // repeat, and unlike dropRecords() it cannot hit records the client has
+    // not read when shedding has moved them to a lower index.
+    size_t dropBefore(uint32_t seq)
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        size_t count = indexOfSeq(seq);
+        if (count == 0)
+            return 0;
+        recordBuffer.erase(recordBuffer.begin(), recordBuffer.begin() + count);
+        generation++;
+        checkWatermarks(nullptr);
+        return count;
     }
 
-    // Drop a range of records from the buffer
+    // Drop a range of records from the buffer. Indexes move whenever
+    // back-pressure sheds, so what a client read at an offset may no longer
+    // be there; prefer dropBefore().
     bool dropRecords(size_t offset, size_t length)
     {
+        std::lock_guard<std::mutex> lock(bufferMutex);
         if (offset >= recordBuffer.size())
         {
             return false;
@@ -174,6 +705,8 @@ public:
 
         // Remove the records
         recordBuffer.erase(start, end);
+        generation++;
+        checkWatermarks(nullptr);
         return true;
     }
 };
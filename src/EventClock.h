@@ -0,0 +1,140 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// Millisecond event clock disciplined by setTime samples.
+//
+// The local timebase is gettimeofday(), which the device never sets: it keeps
+// counting across software and watchdog resets, so a ClockModel saved in RTC
+// memory stays valid after a warm boot. Each setTime adds a (local, reference)
+// sample; like NTP, the offset and the frequency error (skew) are estimated
+// from a least-squares fit over the recent samples instead of trusting the
+// latest one, so BLE latency jitter averages out and the clock keeps good time
+// between syncs.
+
+typedef int64_t EventTime; // ms since the Unix epoch
+
+#define CLOCK_SYNC_SAMPLES 8
+#define CLOCK_MIN_SPAN_S 60  // samples closer than this give too noisy a skew
+#define CLOCK_MAX_SKEW_PPM 500
+#define CLOCK_STEP_MS 2000   // a sample this far off the model restarts the fit
+
+struct ClockModel
+{
+    int64_t anchorLocalUs; // local time of the anchor
+    EventTime anchorRefMs; // reference time at the anchor
+    float skewPpm;         // how fast the reference runs relative to local
+    bool synced;
+};
+
+class EventClock
+{
+private:
+    struct SyncSample
+    {
+        int64_t localUs;
+        EventTime refMs;
+    };
+
+    ClockModel model = {0, 0, 0, false};
+    SyncSample samples[CLOCK_SYNC_SAMPLES];
+    int sampleCount = 0;
+    int nextSample = 0;
+
+    void fit()
+    {
+        const SyncSample &last = samples[(nextSample + CLOCK_SYNC_SAMPLES - 1) % CLOCK_SYNC_SAMPLES];
+
+        // Work relative to the newest sample to keep the doubles small:
+        // x = seconds before it, y = ms the offset differs from its offset
+        double lastOffset = (double)last.refMs - last.localUs / 1000.0;
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        double span = 0;
+        for (int i = 0; i < sampleCount; i++)
+        {
+            double x = (samples[i].localUs - last.localUs) / 1e6;
+            double y = ((double)samples[i].refMs - samples[i].localUs / 1000.0) - lastOffset;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+            span = x < -span ? -x : span;
+        }
+
+        double n = sampleCount;
+        double intercept = 0;
+        if (sampleCount >= 2 && span >= CLOCK_MIN_SPAN_S)
+        {
+            double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx); // ms per s
+            double ppm = slope * 1000.0;
+            if (ppm > CLOCK_MAX_SKEW_PPM)
+                ppm = CLOCK_MAX_SKEW_PPM;
+            if (ppm < -CLOCK_MAX_SKEW_PPM)
+                ppm = -CLOCK_MAX_SKEW_PPM;
+            model.skewPpm = ppm;
+            intercept = (sy - slope * sx) / n;
+        }
+        // else: keep the previous skew estimate and just re-anchor
+
+        model.anchorLocalUs = last.localUs;
+        model.anchorRefMs = (EventTime)(last.localUs / 1000.0 + lastOffset + intercept);
+        model.synced = true;
+    }
+
+public:
+    static int64_t localUs()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, nullptr);
+        return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
+    EventTime toReference(int64_t local) const
+    {
+        if (!model.synced)
+            return local / 1000;
+        int64_t dt = local - model.anchorLocalUs;
+        return model.anchorRefMs + (dt + (int64_t)(dt * (double)model.skewPpm / 1e6)) / 1000;
+    }
+
+    EventTime now() const { return toReference(localUs()); }
+
+    // Feed one reference time, taken as "now"
+    void sync(EventTime referenceMs)
+    {
+        int64_t local = localUs();
+        if (model.synced && llabs(referenceMs - toReference(local)) > CLOCK_STEP_MS)
+        {
+            // Clock was stepped (first sync, timezone mistake, ...): old samples
+            // no longer describe the same line
+            sampleCount = 0;
+            nextSample = 0;
+        }
+
+        samples[nextSample] = {local, referenceMs};
+        nextSample = (nextSample + 1) % CLOCK_SYNC_SAMPLES;
+        if (sampleCount < CLOCK_SYNC_SAMPLES)
+            sampleCount++;
+        fit();
+    }
+
+    // Reference minus local, in ms, at the current instant
+    int64_t getOffsetMs() const
+    {
+        int64_t local = localUs();
+        return toReference(local) - local / 1000;
+    }
+
+    float getSkewPpm() const { return model.skewPpm; }
+    int getSampleCount() const { return sampleCount; }
+    bool isSynced() const { return model.synced; }
+
+    const ClockModel &getModel() const { return model; }
+    void setModel(const ClockModel &m)
+    {
+        model = m;
+        sampleCount = 0;
+        nextSample = 0;
+    }
+};
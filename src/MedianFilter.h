@@ -0,0 +1,210 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+
+// Spike rejection ahead of the detector's EMA. One HX711 conversion that is
+// way off (a bump on the table, a glitch on SCK) would otherwise drag the EMA
+// far enough to break the stability window and fabricate a sip or refill.
+//
+// The filter keeps the last `window` (3, 5 or 7) raw readings and sorts a
+// copy with a fixed sorting network: a straight run of min/max pairs, so the
+// cost is the same for every sample and there are no data-dependent branches
+// (integer min/max are single instructions on the ESP32 and on x86).
+//
+//  - sigmas == 0: running median, the output is always the window's median.
+//  - sigmas > 0:  Hampel filter, the sample passes through unchanged unless
+//    it is more than `sigmas` noise standard deviations from the median,
+//    then it is replaced by the median. Less smoothing, only outliers are
+//    touched.
+//
+// The noise is estimated from the MAD (median absolute deviation). The MAD of
+// 3 to 7 samples is far too jumpy to threshold on directly, and biased low,
+// so the threshold uses a slow average of it, scaled by the small-sample
+// factor for Gaussian noise rather than the textbook 1.4826. A single spike
+// never moves the MAD: it is never the median of the deviations.
+//
+// Either way, samples beyond that bound are counted as rejected (3 sigmas for
+// the plain median), but only once the next sample has shown they were not
+// the first of a new level: the edge of a real step is also off the median
+// until the window catches up. Arduino-free, like SipDetector.
+
+#define MEDIAN_MAX_WINDOW 7
+#define MEDIAN_COUNT_SIGMAS 3.0f // what the plain median counts as rejected
+#define MAD_AVERAGE_SAMPLES 32   // time constant of the noise estimate
+
+class MedianFilter
+{
+private:
+    int window = 0; // 0 = off
+    float sigmas = 0;
+
+    int32_t history[MEDIAN_MAX_WINDOW];
+    int next = 0;
+    int filled = 0;
+    float madAverage = 0; // counts; 0 until the window first fills
+
+    uint32_t samples = 0;
+    uint32_t rejected = 0;
+    bool suspect = false; // last sample was an outlier, not yet counted
+    int32_t suspectValue = 0;
+
+    static inline void exchange(int32_t &a, int32_t &b)
+    {
+        int32_t low = std::min(a, b);
+        b = std::max(a, b);
+        a = low;
+    }
+
+    // Optimal networks: 3, 9 and 16 comparators
+    static void sort3(int32_t *v)
+    {
+        exchange(v[0], v[2]);
+        exchange(v[0], v[1]);
+        exchange(v[1], v[2]);
+    }
+
+    static void sort5(int32_t *v)
+    {
+        exchange(v[0], v[1]);
+        exchange(v[3], v[4]);
+        exchange(v[2], v[4]);
+        exchange(v[2], v[3]);
+        exchange(v[1], v[4]);
+        exchange(v[0], v[3]);
+        exchange(v[0], v[2]);
+        exchange(v[1], v[3]);
+        exchange(v[1], v[2]);
+    }
+
+    static void sort7(int32_t *v)
+    {
+        exchange(v[0], v[6]);
+        exchange(v[2], v[3]);
+        exchange(v[4], v[5]);
+        exchange(v[0], v[2]);
+        exchange(v[1], v[4]);
+        exchange(v[3], v[6]);
+        exchange(v[0], v[1]);
+        exchange(v[2], v[5]);
+        exchange(v[3], v[4]);
+        exchange(v[1], v[2]);
+        exchange(v[4], v[6]);
+        exchange(v[2], v[3]);
+        exchange(v[4], v[5]);
+        exchange(v[1], v[2]);
+        exchange(v[3], v[4]);
+        exchange(v[5], v[6]);
+    }
+
+    // Standard deviation per unit of mean MAD over `window` Gaussian samples
+    // (simulated; tends to 1.4826 for large windows)
+    float sigmaPerMad() const
+    {
+        switch (window)
+        {
+        case 3:
+            return 2.196f;
+        case 5:
+            return 1.806f;
+        default:
+            return 1.688f;
+        }
+    }
+
+    void sort(int32_t *v) const
+    {
+        switch (window)
+        {
+        case 3:
+            sort3(v);
+            break;
+        case 5:
+            sort5(v);
+            break;
+        default:
+            sort7(v);
+            break;
+        }
+    }
+
+public:
+    // Windows other than 3, 5 and 7 are rounded to the nearest one; below 3
+    // turns the filter off
+    void configure(int medianWindow, float outlierSigmas)
+    {
+        if (medianWindow < 3)
+            window = 0;
+        else if (medianWindow < 5)
+            window = 3;
+        else if (medianWindow < 7)
+            window = 5;
+        else
+            window = 7;
+        sigmas = outlierSigmas > 0 ? outlierSigmas : 0;
+        reset();
+    }
+
+    void reset()
+    {
+        next = 0;
+        filled = 0;
+        madAverage = 0;
+        samples = 0;
+        rejected = 0;
+        suspect = false;
+    }
+
+    // Raw counts in, filtered raw counts out. Passes samples through until
+    // the window has filled.
+    float apply(float raw)
+    {
+        if (window == 0)
+            return raw;
+
+        int32_t x = (int32_t)lrintf(raw);
+        history[next] = x;
+        next = next + 1 < window ? next + 1 : 0;
+        samples++;
+        if (filled < window)
+        {
+            filled++;
+            return raw;
+        }
+
+        int32_t sorted[MEDIAN_MAX_WINDOW];
+        std::copy(history, history + window, sorted);
+        sort(sorted);
+        int32_t median = sorted[window / 2];
+
+        // MAD from the same network
+        for (int i = 0; i < window; i++)
+            sorted[i] = abs(history[i] - median);
+        sort(sorted);
+        float mad = (float)sorted[window / 2];
+        if (madAverage == 0)
+            madAverage = mad;
+        else
+            madAverage += (mad - madAverage) / MAD_AVERAGE_SAMPLES;
+
+        // Floored at one count so a perfectly flat signal does not flag
+        // every last-bit change
+        float limit = (sigmas > 0 ? sigmas : MEDIAN_COUNT_SIGMAS) * sigmaPerMad() * fmaxf(madAverage, 1.0f);
+        bool outlier = fabsf((float)(x - median)) > limit;
+
+        // A spike stands alone; a step edge is confirmed by the sample after it
+        if (suspect && fabsf((float)(x - suspectValue)) > limit)
+            rejected++;
+        suspect = outlier;
+        suspectValue = x;
+
+        return (sigmas == 0 || outlier) ? (float)median : raw;
+    }
+
+    bool isEnabled() const { return window > 0; }
+    int getWindow() const { return window; }
+    float getSigmas() const { return sigmas; }
+    uint32_t getSamples() const { return samples; }
+    uint32_t getRejected() const { return rejected; }
+};
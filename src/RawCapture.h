@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+// Burst capture of untouched HX711 counts for diagnosing a misbehaving scale.
+// The sampling loop hands every reading to add(); while a capture is running
+// it is stored with its timestamp in a preallocated buffer, and detection
+// carries on unaffected. The result is downloaded later with readCapture and
+// fits straight into the host replay tools.
+
+#define RAW_CAPTURE_CAPACITY 2048 // samples, 8 bytes each
+
+enum CaptureState
+{
+    CAPTURE_IDLE,
+    CAPTURE_RUNNING,
+    CAPTURE_DONE
+};
+
+inline const char *getCaptureStateStr(CaptureState state)
+{
+    switch (state)
+    {
+    case CAPTURE_RUNNING:
+        return "running";
+    case CAPTURE_DONE:
+        return "done";
+    default:
+        return "idle";
+    }
+}
+
+class RawCapture
+{
+private:
+    // Written by the sampling loop only; `count` publishes them to readers
+    uint32_t timesUs[RAW_CAPTURE_CAPACITY]; // since capture start
+    int32_t counts[RAW_CAPTURE_CAPACITY];
+    std::atomic<uint32_t> count{0};
+    std::atomic<int> state{CAPTURE_IDLE};
+
+    // Set by start(), read by the sampling loop
+    std::atomic<bool> startRequested{false};
+    std::atomic<bool> stopRequested{false};
+    uint32_t durationUs = 0;
+    uint32_t minIntervalUs = 0; // 0 = every reading
+    long tareOffset = 0;        // at capture start, so hosts can tare the counts
+
+    int64_t startUs = 0;
+    int64_t nextDueUs = 0;
+
+public:
+    // rateHz 0 = full sensor rate. Returns false if a capture is running.
+    bool start(float seconds, float rateHz)
+    {
+        if (state == CAPTURE_RUNNING || startRequested)
+            return false;
+        if (seconds > 4000)
+            seconds = 4000; // durationUs is 32-bit; the buffer fills long before
+        durationUs = (uint32_t)(seconds * 1e6f);
+        minIntervalUs = rateHz > 0 ? (uint32_t)(1e6f / rateHz) : 0;
+        stopRequested = false;
+        startRequested = true;
+        return true;
+    }
+
+    void stop() { stopRequested = true; }
+
+    // Called from the sampling loop with every raw reading
+    void add(int32_t raw, long offset, int64_t nowUs)
+    {
+        if (startRequested)
+        {
+            count.store(0, std::memory_order_release);
+            tareOffset = offset;
+            startUs = nowUs;
+            nextDueUs = nowUs;
+            state = CAPTURE_RUNNING;
+            startRequested = false;
+        }
+        if (state != CAPTURE_RUNNING)
+            return;
+
+        uint32_t n = count.load(std::memory_order_relaxed);
+        if (stopRequested || nowUs - startUs >= durationUs || n >= RAW_CAPTURE_CAPACITY)
+        {
+            state = CAPTURE_DONE;
+            return;
+        }
+        if (nowUs < nextDueUs)
+            return;
+
+        timesUs[n] = (uint32_t)(nowUs - startUs);
+        counts[n] = raw;
+        count.store(n + 1, std::memory_order_release);
+        nextDueUs += minIntervalUs;
+        if (nextDueUs < nowUs)
+            nextDueUs = nowUs; // sensor slower than the requested rate
+    }
+
+    CaptureState getState() const { return (CaptureState)state.load(); }
+    uint32_t size() const { return count.load(std::memory_order_acquire); }
+    long getTareOffset() const { return tareOffset; }
+    uint32_t getTimeUs(uint32_t i) const { return timesUs[i]; }
+    int32_t getCount(uint32_t i) const { return counts[i]; }
+};
+
+static RawCapture rawCapture;
+inline RawCapture &getRawCapture() { return rawCapture; }
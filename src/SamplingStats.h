@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+// Time between consecutive sensor reads in loop(). The worst case is what
+// anything sharing the sampling path (command handling, exports) costs us.
+// Also how long the detector itself takes per sample, which has to fit in the
+// sampling period with everything else.
+struct SamplingCounters
+{
+    uint32_t maxGapUs = 0;
+    uint64_t totalGapUs = 0;
+    uint32_t gaps = 0;
+    uint32_t maxDetectUs = 0;
+    uint64_t totalDetectUs = 0;
+    uint32_t detects = 0;
+    uint32_t rejectedSamples = 0; // live prefilter, since boot (not reset)
+
+    uint32_t meanGapUs() const { return gaps ? (uint32_t)(totalGapUs / gaps) : 0; }
+    uint32_t meanDetectUs() const { return detects ? (uint32_t)(totalDetectUs / detects) : 0; }
+};
+
+// Written only by the sampling loop; other tasks ask for a reset and read a
+// copy taken under the lock, so a mean never pairs a total and a count from
+// different samples (the totals are 64-bit, two stores on the ESP32).
+class SamplingStats
+{
+private:
+    mutable std::mutex mutex; // guards counters
+    SamplingCounters counters;
+    int64_t lastSampleUs = 0; // sampling loop only
+    std::atomic<bool> resetRequested{false};
+
+public:
+    void record(int64_t nowUs)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (resetRequested)
+        {
+            uint32_t rejected = counters.rejectedSamples;
+            counters = SamplingCounters();
+            counters.rejectedSamples = rejected;
+            resetRequested = false;
+        }
+        else if (lastSampleUs != 0)
+        {
+            uint32_t gap = (uint32_t)(nowUs - lastSampleUs);
+            if (gap > counters.maxGapUs)
+                counters.maxGapUs = gap;
+            counters.totalGapUs += gap;
+            counters.gaps++;
+        }
+        lastSampleUs = nowUs;
+    }
+
+    void recordDetect(uint32_t us, uint32_t rejectedSamples)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (us > counters.maxDetectUs)
+            counters.maxDetectUs = us;
+        counters.totalDetectUs += us;
+        counters.detects++;
+        counters.rejectedSamples = rejectedSamples;
+    }
+
+    // Applied by the sampling loop at its next read
+    void requestReset() { resetRequested = true; }
+
+    SamplingCounters snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+};
+
+static SamplingStats samplingStats;
+inline SamplingStats &getSamplingStats() { return samplingStats; }
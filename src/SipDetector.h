@@ -0,0 +1,385 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <mutex>
+#include "MedianFilter.h"
+
+// Kept free of Arduino.h on purpose: the same detector runs on the device and
+// in the host-side replay tool (tools/detector_eval.cpp).
+
+#define MAX_STABILITY_WINDOW 32
+#define MAX_EVAL_SETS 8
+
+// Everything that used to be a hand-picked macro in main.cpp
+struct DetectorParams
+{
+    float emaAlpha;           // Smoothing factor (0 to 1), higher = more responsive
+    float stabilityTolerance; // max spread (grams) inside the window to call it stable
+    int stabilityWindow;      // window for stability check, <= MAX_STABILITY_WINDOW
+    float zeroThreshold;      // ≤ this == “nothing on scale”
+    float changeThreshold;    // Threshold for confirming sips/refills
+    int medianWindow;         // spike prefilter: 0 = off, else 3, 5 or 7 samples
+    float outlierSigmas;      // 0 = plain median, > 0 = Hampel (replace outliers only)
+};
+
+// The live detector's parameters; evalAdd and the host tools start from
+// these too, so a set that leaves fields out differs only where it says so
+const DetectorParams DEFAULT_DETECTOR_PARAMS = {
+    0.60f, // emaAlpha
+    1.0f,  // stabilityTolerance, grams
+    10,    // stabilityWindow, samples
+    1.0f,  // zeroThreshold, grams
+    2.0f,  // changeThreshold, grams
+    5,     // medianWindow, samples
+    3.0f,  // outlierSigmas: Hampel, readings > 3 sigmas off the median are replaced
+};
+
+// Linear two-point calibration: raw reading -> grams
+struct Calibration
+{
+    float noLoad;   // reading at no load
+    float atLoad;   // reading at `weight`
+    float weight;   // actual weight in grams
+
+    float toGrams(float raw) const
+    {
+        return (raw - noLoad) * weight / (atLoad - noLoad);
+    }
+};
+
+enum EventState
+{
+    WAITING,        // Scale has never seen a cup (or was just tared)
+    CUP_ON_STABLE,  // Cup present, weight is stable
+    CUP_OFF_STABLE, // Cup removed, weight ~ 0 g and stable
+    TRANSITION,     // Any unstable period between plateaus
+    NUM_EVENT_STATES
+};
+
+inline const char *getStateStr(EventState state)
+{
+    switch (state)
+    {
+    case WAITING:
+        return "waiting";
+    case CUP_ON_STABLE:
+        return "plateau A";
+    case TRANSITION:
+        return "transitioning";
+    case CUP_OFF_STABLE:
+        return "cup off stable";
+    default:
+        return "unknown";
+    }
+}
+
+// What a single sample did to the state machine
+enum DetectorEvent
+{
+    EVENT_NONE,
+    EVENT_CUP_PLACED,  // first cup seen, reference weight taken
+    EVENT_CUP_REMOVED, // landed on the zero plateau
+    EVENT_NOOP,        // cup back with |Δ| below changeThreshold
+    EVENT_SIP,
+    EVENT_REFILL
+};
+
+class SipDetector
+{
+private:
+    // Each sample is reduced to one of these before looking up the table
+    enum Input
+    {
+        IN_UNSTABLE,      // still unstable
+        IN_LEFT_PLATEAU,  // stable -> unstable edge
+        IN_STABLE_EMPTY,  // stable and ≤ zeroThreshold
+        IN_STABLE_LOADED, // stable and > zeroThreshold
+        NUM_INPUTS
+    };
+
+    enum Action
+    {
+        ACT_NONE,
+        ACT_PLACE,    // take the first reference weight
+        ACT_REMOVE,   // cup lifted off
+        ACT_CLASSIFY  // cup put back: sip / refill / no-op
+    };
+
+    struct Transition
+    {
+        EventState next;
+        Action action;
+    };
+
+    // [state][input] -> next state + action. Same behaviour as the old switch:
+    // plateaus are only left on a stable->unstable edge, and TRANSITION only
+    // resolves once stability returns.
+    static const Transition &lookup(EventState state, Input input)
+    {
+        static const Transition table[NUM_EVENT_STATES][NUM_INPUTS] = {
+            /* WAITING        */ {{WAITING, ACT_NONE}, {WAITING, ACT_NONE}, {WAITING, ACT_NONE}, {CUP_ON_STABLE, ACT_PLACE}},
+            /* CUP_ON_STABLE  */ {{CUP_ON_STABLE, ACT_NONE}, {TRANSITION, ACT_NONE}, {CUP_ON_STABLE, ACT_NONE}, {CUP_ON_STABLE, ACT_NONE}},
+            /* CUP_OFF_STABLE */ {{CUP_OFF_STABLE, ACT_NONE}, {TRANSITION, ACT_NONE}, {CUP_OFF_STABLE, ACT_NONE}, {CUP_OFF_STABLE, ACT_NONE}},
+            /* TRANSITION     */ {{TRANSITION, ACT_NONE}, {TRANSITION, ACT_NONE}, {CUP_OFF_STABLE, ACT_REMOVE}, {CUP_ON_STABLE, ACT_CLASSIFY}},
+        };
+        return table[state][input];
+    }
+
+    DetectorParams params;
+    Calibration calibration;
+
+    MedianFilter prefilter;
+    float emaValue = 0;
+    float readings[MAX_STABILITY_WINDOW];
+    int readingIndex = 0;
+    bool windowFilled = false;
+    float windowMin = 0;
+    float windowMax = 0;
+
+    bool stable = false;
+    bool wasStable = false;
+    float grams = 0;
+
+    EventState state = WAITING;
+    float lastCupWeight = 0.0f; // plateaus with cup on
+    float lastDelta = 0.0f;     // +ve = sip, set on EVENT_SIP/REFILL/NOOP
+
+    bool checkStability(float value)
+    {
+        int window = params.stabilityWindow;
+        readings[readingIndex] = value;
+        readingIndex = (readingIndex + 1) % window;
+
+        // Wait for window to fill up
+        if (!windowFilled && readingIndex == 0)
+        {
+            windowFilled = true;
+        }
+        if (!windowFilled)
+        {
+            return false;
+        }
+
+        windowMin = readings[0];
+        windowMax = readings[0];
+        for (int i = 1; i < window; i++)
+        {
+            windowMin = fminf(windowMin, readings[i]);
+            windowMax = fmaxf(windowMax, readings[i]);
+        }
+        return windowMax - windowMin <= params.stabilityTolerance;
+    }
+
+public:
+    // The part of the detector worth carrying across a reset. The stability
+    // window is left out on purpose: it refills within stabilityWindow samples.
+    struct Checkpoint
+    {
+        float emaValue;
+        EventState state;
+        float lastCupWeight;
+    };
+
+    SipDetector() : params{}, calibration{} {}
+    SipDetector(const DetectorParams &p, const Calibration &c) { configure(p, c); }
+
+    void configure(const DetectorParams &p, const Calibration &c)
+    {
+        params = p;
+        if (params.stabilityWindow < 1)
+            params.stabilityWindow = 1;
+        if (params.stabilityWindow > MAX_STABILITY_WINDOW)
+            params.stabilityWindow = MAX_STABILITY_WINDOW;
+        calibration = c;
+        prefilter.configure(params.medianWindow, params.outlierSigmas);
+        reset();
+    }
+
+    void reset()
+    {
+        prefilter.reset();
+        emaValue = 0;
+        readingIndex = 0;
+        windowFilled = false;
+        stable = wasStable = false;
+        grams = 0;
+        state = WAITING;
+        lastCupWeight = 0;
+        lastDelta = 0;
+    }
+
+    // Feed one raw reading (tare already applied). Returns what happened.
+    DetectorEvent update(float rawValue)
+    {
+        rawValue = prefilter.apply(rawValue);
+
+        if (emaValue == 0)
+        {
+            // Initialize EMA with first reading
+            emaValue = rawValue;
+        }
+        else
+        {
+            // EMA formula: EMAt = α * Xt + (1 - α) * EMAt-1
+            emaValue = params.emaAlpha * rawValue + (1 - params.emaAlpha) * emaValue;
+        }
+
+        grams = fmaxf(0.0f, calibration.toGrams(emaValue));
+
+        // Round very small values to 0 to prevent noise
+        if (fabsf(grams) < 0.1f)
+        {
+            grams = 0;
+        }
+
+        wasStable = stable;
+        stable = checkStability(grams);
+
+        Input input;
+        if (!stable)
+            input = wasStable ? IN_LEFT_PLATEAU : IN_UNSTABLE;
+        else
+            input = grams <= params.zeroThreshold ? IN_STABLE_EMPTY : IN_STABLE_LOADED;
+
+        const Transition &t = lookup(state, input);
+        state = t.next;
+
+        switch (t.action)
+        {
+        case ACT_PLACE:
+            lastCupWeight = grams;
+            return EVENT_CUP_PLACED;
+        case ACT_REMOVE:
+            return EVENT_CUP_REMOVED;
+        case ACT_CLASSIFY:
+        {
+            DetectorEvent event;
+            lastDelta = lastCupWeight - grams; // +ve = sip
+            if (fabsf(lastDelta) < params.changeThreshold)
+                event = EVENT_NOOP;
+            else
+                event = lastDelta > 0 ? EVENT_SIP : EVENT_REFILL;
+            lastCupWeight = grams; // new baseline
+            return event;
+        }
+        default:
+            return EVENT_NONE;
+        }
+    }
+
+    Checkpoint checkpoint() const { return {emaValue, state, lastCupWeight}; }
+
+    void restore(const Checkpoint &c)
+    {
+        reset();
+        emaValue = c.emaValue;
+        state = c.state < NUM_EVENT_STATES ? c.state : WAITING;
+        lastCupWeight = c.lastCupWeight;
+    }
+
+    const DetectorParams &getParams() const { return params; }
+    EventState getState() const { return state; }
+    bool isStable() const { return stable; }
+    bool isWindowFilled() const { return windowFilled; }
+    float getGrams() const { return grams; }
+    float getEmaValue() const { return emaValue; }
+    float getWindowMin() const { return windowMin; }
+    float getWindowMax() const { return windowMax; }
+    float getLastCupWeight() const { return lastCupWeight; }
+    float getLastDelta() const { return lastDelta; }
+    const MedianFilter &getPrefilter() const { return prefilter; }
+};
+
+// Counts what one parameter set would have logged
+struct DetectorTally
+{
+    unsigned long sips = 0;
+    unsigned long refills = 0;
+    unsigned long noops = 0;
+    float sipGrams = 0;
+    float refillGrams = 0;
+    unsigned long rejected = 0; // samples the prefilter flagged as spikes
+};
+
+// Runs up to MAX_EVAL_SETS detectors side by side over the same raw stream,
+// so a parameter sweep costs one pass instead of one reflash per attempt.
+// Fed by the sampling loop, managed from the command task, hence the lock.
+class DetectorBank
+{
+private:
+    mutable std::mutex mutex;
+    SipDetector detectors[MAX_EVAL_SETS];
+    DetectorTally tallies[MAX_EVAL_SETS];
+    Calibration calibration = {};
+    int count = 0;
+
+public:
+    // All sets share the live calibration; only the detector params vary
+    void setCalibration(const Calibration &c) { calibration = c; }
+    Calibration getCalibration() const { return calibration; }
+
+    // Returns the slot index, or -1 when the bank is full
+    int add(const DetectorParams &p)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (count >= MAX_EVAL_SETS)
+            return -1;
+        detectors[count].configure(p, calibration);
+        tallies[count] = DetectorTally();
+        return count++;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        count = 0;
+    }
+
+    void resetTallies()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < count; i++)
+        {
+            detectors[i].reset();
+            tallies[i] = DetectorTally();
+        }
+    }
+
+    void update(float rawValue)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < count; i++)
+        {
+            switch (detectors[i].update(rawValue))
+            {
+            case EVENT_SIP:
+                tallies[i].sips++;
+                tallies[i].sipGrams += detectors[i].getLastDelta();
+                break;
+            case EVENT_REFILL:
+                tallies[i].refills++;
+                tallies[i].refillGrams -= detectors[i].getLastDelta();
+                break;
+            case EVENT_NOOP:
+                tallies[i].noops++;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    int size() const { return count; }
+    const SipDetector &getDetector(int i) const { return detectors[i]; }
+    DetectorTally getTally(int i) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        DetectorTally t = tallies[i];
+        t.rejected = detectors[i].getPrefilter().getRejected();
+        return t;
+    }
+};
+
+// Global instance for on-device evaluation
+static DetectorBank detectorBank;
+inline DetectorBank &getDetectorBank() { return detectorBank; }
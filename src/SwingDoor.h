@@ -0,0 +1,223 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include "EventClock.h"
+
+// Streaming compression of the weight series into segments, within a fixed
+// error bound. Arduino-free so tools/compress_eval.cpp can replay traces
+// through exactly the same code.
+//
+//  - COMPRESSION_CONSTANT: piecewise-constant. A segment grows while all of
+//    its samples fit in a 2*error band and is stored at the band's midpoint.
+//  - COMPRESSION_LINEAR: swing-door. Vertices are emitted such that linear
+//    interpolation between consecutive vertices stays within error of every
+//    input sample. The vertex closing a segment is placed on the centre of
+//    the door rather than at the raw sample, which is what keeps the bound
+//    strict.
+
+enum CompressionMode
+{
+    COMPRESSION_OFF,
+    COMPRESSION_CONSTANT,
+    COMPRESSION_LINEAR
+};
+
+inline const char *getCompressionModeStr(CompressionMode mode)
+{
+    switch (mode)
+    {
+    case COMPRESSION_CONSTANT:
+        return "constant";
+    case COMPRESSION_LINEAR:
+        return "linear";
+    default:
+        return "off";
+    }
+}
+
+struct Segment
+{
+    EventTime start;
+    EventTime end; // == start for a linear vertex
+    float value;
+};
+
+#define SWING_DOOR_MAX_OUTPUT 2 // most segments one add() can produce
+
+class SwingDoor
+{
+private:
+    CompressionMode mode = COMPRESSION_OFF;
+    float error = 0.5f;
+
+    // Linear: the last emitted vertex, and the door opened from it
+    bool hasAnchor = false;
+    EventTime anchorTime = 0;
+    float anchorValue = 0;
+    double slopeHigh = INFINITY;
+    double slopeLow = -INFINITY;
+
+    // Last input sample not yet covered by an output
+    bool hasLast = false;
+    EventTime lastTime = 0;
+    float lastValue = 0;
+
+    // Constant: band of the open segment
+    EventTime segmentStart = 0;
+    float segmentMin = 0;
+    float segmentMax = 0;
+
+    uint32_t inputs = 0;
+    uint32_t outputs = 0;
+
+    void openDoor(EventTime t, float v)
+    {
+        double dt = (double)(t - anchorTime);
+        slopeHigh = (v + error - anchorValue) / dt;
+        slopeLow = (v - error - anchorValue) / dt;
+    }
+
+    // Vertex at lastTime on the centre of the current door
+    Segment closeDoor()
+    {
+        double slope = (slopeHigh + slopeLow) / 2;
+        float value = anchorValue + (float)(slope * (double)(lastTime - anchorTime));
+        anchorTime = lastTime;
+        anchorValue = value;
+        return {lastTime, lastTime, value};
+    }
+
+    int addLinear(EventTime t, float v, Segment *out)
+    {
+        if (!hasAnchor)
+        {
+            hasAnchor = true;
+            anchorTime = t;
+            anchorValue = v;
+            out[0] = {t, t, v};
+            return 1;
+        }
+        if (t <= anchorTime || (hasLast && t <= lastTime))
+            return 0; // time must move forward
+
+        int n = 0;
+        double dt = (double)(t - anchorTime);
+        double high = fmin(slopeHigh, (v + error - anchorValue) / dt);
+        double low = fmax(slopeLow, (v - error - anchorValue) / dt);
+        if (low > high && hasLast)
+        {
+            // The door closed: end the segment at the previous sample
+            out[n++] = closeDoor();
+            openDoor(t, v);
+        }
+        else
+        {
+            slopeHigh = high;
+            slopeLow = low;
+        }
+
+        hasLast = true;
+        lastTime = t;
+        lastValue = v;
+        return n;
+    }
+
+    int addConstant(EventTime t, float v, Segment *out)
+    {
+        if (!hasLast)
+        {
+            segmentStart = t;
+            segmentMin = segmentMax = v;
+            hasLast = true;
+            lastTime = t;
+            return 0;
+        }
+
+        int n = 0;
+        float newMin = fminf(segmentMin, v);
+        float newMax = fmaxf(segmentMax, v);
+        if (newMax - newMin > 2 * error)
+        {
+            out[n++] = {segmentStart, lastTime, (segmentMin + segmentMax) / 2};
+            segmentStart = t;
+            newMin = newMax = v;
+        }
+        segmentMin = newMin;
+        segmentMax = newMax;
+        lastTime = t;
+        return n;
+    }
+
+public:
+    void configure(CompressionMode m, float errorBound)
+    {
+        mode = m;
+        error = errorBound;
+        reset();
+    }
+
+    void reset()
+    {
+        restart();
+        inputs = 0;
+        outputs = 0;
+    }
+
+    // Start a new series with the next sample, keeping the counters. After
+    // flush(), for when time jumps or the samples stop for a while: samples
+    // older than the last one are otherwise ignored, and no segment should
+    // span a clock step or a gap in logging.
+    void restart()
+    {
+        hasAnchor = false;
+        hasLast = false;
+        slopeHigh = INFINITY;
+        slopeLow = -INFINITY;
+    }
+
+    // Feed one sample; writes up to SWING_DOOR_MAX_OUTPUT finished segments
+    // to `out` and returns how many
+    int add(EventTime t, float v, Segment *out)
+    {
+        int n = 0;
+        if (mode == COMPRESSION_LINEAR)
+            n = addLinear(t, v, out);
+        else if (mode == COMPRESSION_CONSTANT)
+            n = addConstant(t, v, out);
+        inputs++;
+        outputs += n;
+        return n;
+    }
+
+    // Emit whatever the open segment covers so far. Compression continues
+    // from there, so this is safe to call at any point.
+    int flush(Segment *out)
+    {
+        if (!hasLast)
+            return 0;
+
+        int n = 0;
+        if (mode == COMPRESSION_LINEAR)
+        {
+            out[n++] = closeDoor();
+            slopeHigh = INFINITY;
+            slopeLow = -INFINITY;
+        }
+        else if (mode == COMPRESSION_CONSTANT)
+        {
+            out[n++] = {segmentStart, lastTime, (segmentMin + segmentMax) / 2};
+        }
+        hasLast = false;
+        outputs += n;
+        return n;
+    }
+
+    CompressionMode getMode() const { return mode; }
+    float getError() const { return error; }
+    bool hasPending() const { return hasLast; }
+    uint32_t getInputs() const { return inputs; }
+    uint32_t getOutputs() const { return outputs; }
+
+    // Samples in per record out
+    float getRatio() const { return outputs ? (float)inputs / outputs : 0; }
+};
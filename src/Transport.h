@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+#include <functional>
+
+// The link underneath BtServer. On the device this is BleTransport; on a
+// Linux host tools/host/LoopbackTransport.h stands in for it, so the whole
+// command and export path can be driven without a board or a phone.
+class Transport
+{
+public:
+    typedef std::function<void(const char *data, size_t length)> ReceiveHandler;
+    typedef std::function<void(bool connected)> ConnectionHandler;
+
+    virtual ~Transport() {}
+
+    virtual void begin() = 0;
+    virtual bool isConnected() const = 0;
+
+    // One notification. Like a BLE notification, anything past
+    // getMaxPayload() bytes is cut off by the link. False if the link did
+    // not take it (not connected, or its queue is full); try again later.
+    virtual bool send(const char *data, size_t length) = 0;
+    virtual size_t getMaxPayload() const = 0;
+
+    // Set before begin()
+    void onReceive(ReceiveHandler handler) { receiveHandler = handler; }
+    void onConnectionChange(ConnectionHandler handler) { connectionHandler = handler; }
+
+protected:
+    ReceiveHandler receiveHandler;
+    ConnectionHandler connectionHandler;
+};
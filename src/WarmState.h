@@ -0,0 +1,153 @@
+#pragma once
+#include <Arduino.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <atomic>
+#include "DataLogger.h"
+#include "SipDetector.h"
+
+// Checkpoint kept in RTC slow memory so a watchdog reset, panic or the `reset`
+// command does not lose the tare, the filter/state machine or unsynced records.
+// RTC_NOINIT memory survives those resets but not a power cycle, so the
+// contents are only trusted when the magic and checksums match.
+
+#define WARM_STATE_MAGIC 0x57A4B008 // bump when the layout changes
+#define WARM_STATE_MAX_RECORDS 64 // records kept across a reset, sips and refills first
+
+struct WarmState
+{
+    uint32_t magic;
+    long tareOffset;
+    SipDetector::Checkpoint detector;
+    EventTime lastCupTime;
+    ClockModel clock;
+    uint32_t headerChecksum; // covers everything above but the magic
+
+    uint32_t recordCount;
+    Record records[WARM_STATE_MAX_RECORDS];
+    uint32_t recordsChecksum; // covers recordCount and records
+};
+
+RTC_NOINIT_ATTR static WarmState rtcWarmState;
+
+// Boot timing, reported by getStats
+struct BootStats
+{
+    bool warmBoot = false;
+    int64_t firstSampleUs = -1; // esp_timer time of first valid sample
+};
+
+class WarmRestart
+{
+private:
+    bool warm = false;
+    uint32_t savedGeneration = 0;
+    bool recordsSaved = false;
+    std::atomic<bool> invalidated{false}; // set from the command task
+
+    static uint32_t checksum(const void *data, size_t length)
+    {
+        // FNV-1a
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < length; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    static uint32_t headerChecksum(const WarmState &s)
+    {
+        return checksum(&s.tareOffset, offsetof(WarmState, headerChecksum) - offsetof(WarmState, tareOffset));
+    }
+
+    static uint32_t recordsChecksum(const WarmState &s)
+    {
+        return checksum(&s.recordCount,
+                        offsetof(WarmState, recordsChecksum) - offsetof(WarmState, recordCount));
+    }
+
+    static bool isWarmResetReason(esp_reset_reason_t reason)
+    {
+        switch (reason)
+        {
+        case ESP_RST_SW:
+        case ESP_RST_PANIC:
+        case ESP_RST_INT_WDT:
+        case ESP_RST_TASK_WDT:
+        case ESP_RST_WDT:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+public:
+    // Call once at boot. True if the checkpoint from before the reset is usable.
+    bool load()
+    {
+        const WarmState &s = rtcWarmState;
+        warm = isWarmResetReason(esp_reset_reason()) &&
+               s.magic == WARM_STATE_MAGIC &&
+               s.headerChecksum == headerChecksum(s);
+        return warm;
+    }
+
+    bool isWarm() const { return warm; }
+    const WarmState &state() const { return rtcWarmState; }
+
+    // Records are checksummed separately, so a torn record copy only costs
+    // the records and not the tare
+    bool hasRecords() const
+    {
+        const WarmState &s = rtcWarmState;
+        return warm && s.recordCount <= WARM_STATE_MAX_RECORDS &&
+               s.recordsChecksum == recordsChecksum(s);
+    }
+
+    // Cheap enough to run every sample; the record copy only happens when the
+    // logger's buffer actually changed.
+    void checkpoint(long tareOffset, const SipDetector::Checkpoint &detector,
+                    EventTime lastCupTime, const DataLogger &logger)
+    {
+        if (invalidated)
+            return;
+
+        WarmState &s = rtcWarmState;
+        s.tareOffset = tareOffset;
+        s.detector = detector;
+        s.lastCupTime = lastCupTime;
+        s.clock = logger.getClockModel();
+        s.headerChecksum = headerChecksum(s);
+
+        if (!recordsSaved || logger.getGeneration() != savedGeneration)
+        {
+            s.recordCount = logger.copyNewestEventsFirst(WARM_STATE_MAX_RECORDS, s.records, &savedGeneration);
+            s.recordsChecksum = recordsChecksum(s);
+            recordsSaved = true;
+        }
+
+        // Last, and only if no cold reset came in meanwhile
+        if (!invalidated)
+            s.magic = WARM_STATE_MAGIC;
+    }
+
+    // Sticky, so no later checkpoint revives the state. Runs on the command
+    // task while the loop core may be in the middle of a checkpoint that
+    // already passed the flag check, so clear the magic again once that one
+    // has had `settleMs` (more than a sample period) to finish.
+    void invalidate(uint32_t settleMs)
+    {
+        invalidated = true;
+        rtcWarmState.magic = 0;
+        delay(settleMs);
+        rtcWarmState.magic = 0;
+    }
+};
+
+static WarmRestart warmRestart;
+static BootStats bootStats;
+inline WarmRestart &getWarmRestart() { return warmRestart; }
+inline BootStats &getBootStats() { return bootStats; }
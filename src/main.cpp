@@ -1,12 +1,19 @@
 #include <Arduino.h>
+#include <atomic>
 #include <deque>
 #include <mutex>
 #include "HX711.h"
 #include "StatusPrinter.h"
 #include "DataLogger.h"
+#include "SipDetector.h"
+#include "WarmState.h"
+#include "SamplingStats.h"
+#include "RawCapture.h"
 #include "BtServer.h"
+#include "BleTransport.h"
 
 HX711 scale;
+BleTransport bleTransport;
 
 // Use the pins you wired
 #define DT 21
@@ -23,56 +30,29 @@ HX711 scale;
 #define WEIGHT_AT_LOAD_1 950          // actual weight in grams
 #endif
 
-// Stabilization settings
-#define STABILITY_TOLERANCE 1.0 // in grams
-#define SAMPLING_RATE_MS 10     // sampling period
-
-#define EMA_ALPHA 0.60f     // Smoothing factor (0 to 1), higher = more responsive
-#define STABILITY_WINDOW 10 // window for stability check
-
-// Secondary window for stability detection
-float stableReadings[STABILITY_WINDOW];
-int stableIndex = 0;
-bool isStable = false;
+#define SAMPLING_RATE_MS 10 // sampling period at boot
 
 // Event detection settings
-#define DELTA_THRESHOLD 1.0             // Threshold for detecting rises/drops
-#define CHANGE_DETECTION_THRESHOLD 2.0f // Threshold for confirming sips/refills
-#define DIRECTION_WINDOW 3              // Number of samples to average for direction detection
+#define DELTA_THRESHOLD 1.0 // Threshold for detecting rises/drops
+#define DIRECTION_WINDOW 3  // Number of samples to average for direction detection
 
-#define ZERO_THRESHOLD 1.0f // ≤ this == “nothing on scale”
+// The detector's own tuning (EMA, stability window, thresholds, spike
+// prefilter) is DEFAULT_DETECTOR_PARAMS in SipDetector.h, shared with the
+// evaluation sets and the host tools.
 
-// State machine
-// Replaces the old enum
-enum EventState
-{
-  WAITING,        // Scale has never seen a cup (or was just tared)
-  CUP_ON_STABLE,  // Cup present, weight is stable
-  CUP_OFF_STABLE, // Cup removed, weight ~ 0 g and stable
-  TRANSITION      // Any unstable period between plateaus
+const Calibration calibration = {
+    CALIBRATION_AT_NO_LOAD,
+    CALIBRATION_AT_LOAD_1,
+    WEIGHT_AT_LOAD_1,
 };
 
-const char *getStateStr(EventState state)
-{
-  switch (state)
-  {
-  case WAITING:
-    return "waiting";
-  case CUP_ON_STABLE:
-    return "plateau A";
-  case TRANSITION:
-    return "transitioning";
-  case CUP_OFF_STABLE:
-    return "cup off stable";
-  default:
-    return "unknown";
-  }
-}
+SipDetector detector(DEFAULT_DETECTOR_PARAMS, calibration);
+
+std::atomic<int> samplingRateHz{1000 / SAMPLING_RATE_MS}; // setSamplingRate changes it
 
 float baselineWeight = 0;
 float eventStartWeight = 0;
 time_t eventStartTime = 0;
-bool wasStable = false; // Moved here from loop()
 float lastStableWeight = 0.0f;
 float dropStartWeight = 0.0f;
 float postDropWeight = 0.0f;
@@ -81,10 +61,9 @@ float preDropWeight = 0;
 float directionBuffer[DIRECTION_WINDOW] = {0};
 int directionIndex = 0;
 
-float emaValue = 0; // Current EMA value
-
-EventState eventState = WAITING;
 EventState prevState = WAITING;
+EventTime lastCupTime = 0; // when cup was lifted
+
 float getAverageDirection(float currentValue, float baselineValue)
 {
   float currentDelta = currentValue - baselineValue;
@@ -99,88 +78,63 @@ float getAverageDirection(float currentValue, float baselineValue)
   return sum / DIRECTION_WINDOW;
 }
 
-void processStateDetection(float grams, bool isStable, bool wasStable)
+void processStateDetection(DetectorEvent event)
 {
-  static float lastCupWeight = 0.0f;    // plateaus with cup on
-  static unsigned long lastCupTime = 0; // when cup was lifted
+  switch (event)
+  {
+  case EVENT_CUP_PLACED:
+    eventPrinter.printfLevel(2, "Cup placed: %.1fg", detector.getGrams());
+    break;
 
-  switch (eventState)
+  case EVENT_CUP_REMOVED:
+    lastCupTime = getDataLogger().now();
+    eventPrinter.printfLevel(2, "Cup removed (%.1fg → 0g)", detector.getLastCupWeight());
+    break;
+
+  case EVENT_NOOP:
+    eventPrinter.printfLevel(1, "No‑op Δ=%.1fg", detector.getLastDelta());
+    break;
+
+  case EVENT_SIP:
   {
-  /* ────────────────────────────────────────────────────
-     Never saw a cup yet.  First stable reading > 1 g
-     becomes our reference weight, but does *not* fire
-     any event. */
-  case WAITING:
-    if (isStable && grams > ZERO_THRESHOLD)
-    {
-      lastCupWeight = grams;
-      eventState = CUP_ON_STABLE;
-      eventPrinter.printfLevel(2, "Cup placed: %.1fg", grams);
-    }
+    float delta = detector.getLastDelta();
+    eventPrinter.printfLevel(0, "Sip  %.1fg  (%.1fg → %.1fg)",
+                             delta, detector.getGrams() + delta, detector.getGrams());
+    getDataLogger().addSip(lastCupTime, delta);
     break;
+  }
 
-  /* ────────────────────────────────────────────────────
-     We’re on a plateau with a cup.  Leaving the plateau
-     (unstable) switches to TRANSITION.  Landing at ~0 g
-     and stable sets CUP_OFF_STABLE. */
-  case CUP_ON_STABLE:
-    if (!isStable && wasStable)
-    {
-      eventState = TRANSITION;
-    }
+  case EVENT_REFILL:
+  {
+    float delta = detector.getLastDelta();
+    eventPrinter.printfLevel(0, "Refill +%.1fg  (%.1fg → %.1fg)",
+                             -delta, detector.getGrams() + delta, detector.getGrams());
+    getDataLogger().addRefill(lastCupTime, -delta);
     break;
+  }
 
-  /* ────────────────────────────────────────────────────
-     Cup was lifted and is off the scale (stable ≤ 1 g).
-     Any unstable reading kicks us to TRANSITION; the
-     *next* stable >1 g is a new cup‑on plateau, where we
-     classify the Δ. */
-  case CUP_OFF_STABLE:
-    if (!isStable && wasStable)
-    {
-      eventState = TRANSITION;
-    }
+  default:
     break;
+  }
+}
+
+// BLE init runs on core 0 while the loop core tares and starts sampling
+void bleSetupTask(void *)
+{
+  btServer->setup();
 
-  /* ────────────────────────────────────────────────────
-     Transitional noise (cup being moved).  We only care
-     once stability returns. */
-  case TRANSITION:
-    if (isStable)
+  if (!getWarmRestart().isWarm())
+  {
+    // startup indicator
+    for (int i = 0; i < 3; i++)
     {
-      if (grams <= ZERO_THRESHOLD)
-      {
-        // Cup just left the scale → CUP_OFF plateau
-        eventState = CUP_OFF_STABLE;
-        lastCupTime = getDataLogger().getCorrectedTime();
-        eventPrinter.printfLevel(2, "Cup removed (%.1fg → 0g)", lastCupWeight);
-      }
-      else
-      {                                      // cup put back
-        float delta = lastCupWeight - grams; // +ve = sip
-        if (fabs(delta) < CHANGE_DETECTION_THRESHOLD)
-        {
-          eventPrinter.printfLevel(1, "No‑op Δ=%.1fg", delta);
-        }
-        else if (delta > 0)
-        {
-          eventPrinter.printfLevel(0, "Sip  %.1fg  (%.1fg → %.1fg)",
-                                   delta, lastCupWeight, grams);
-          getDataLogger().addSip(lastCupTime, delta);
-        }
-        else
-        {
-          eventPrinter.printfLevel(0, "Refill +%.1fg  (%.1fg → %.1fg)",
-                                   -delta, lastCupWeight, grams);
-          getDataLogger().addRefill(lastCupTime, -delta);
-        }
-
-        lastCupWeight = grams; // new baseline
-        eventState = CUP_ON_STABLE;
-      }
+      digitalWrite(2, HIGH);
+      delay(100);
+      digitalWrite(2, LOW);
+      delay(100);
     }
-    break;
   }
+  vTaskDelete(nullptr);
 }
 
 void setup()
@@ -189,25 +143,40 @@ void setup()
   pinMode(2, OUTPUT);
 
   scale.begin(DT, SCK);
-
-  statusPrinter.printf("Taring...");
   scale.set_scale();
-  scale.tare();
+  getDetectorBank().setCalibration(calibration);
 
-  // startup indicator
-  for (int i = 0; i < 3; i++)
-  {
-    digitalWrite(2, HIGH);
-    delay(100);
-    digitalWrite(2, LOW);
-    delay(100);
-  }
+  bool warm = getWarmRestart().load();
+  getBootStats().warmBoot = warm;
 
   // Initialize BtServer
-  int samplingRateHz = 1000 / SAMPLING_RATE_MS; // Calculate Hz from ms
   statusPrinter.printf("starting server");
-  btServer = new BtServer(samplingRateHz);
-  btServer->setup();
+  btServer = new BtServer(bleTransport, samplingRateHz);
+  btServer->startCommandTask();
+  xTaskCreatePinnedToCore(bleSetupTask, "bleSetup", 8192, nullptr, 1, nullptr, 0);
+
+  if (warm)
+  {
+    // Pick up where we were before the reset, without re-taring
+    const WarmState &state = getWarmRestart().state();
+    scale.set_offset(state.tareOffset);
+    detector.restore(state.detector);
+    prevState = detector.getState();
+    lastCupTime = state.lastCupTime;
+    getDataLogger().setClockModel(state.clock);
+    if (getWarmRestart().hasRecords())
+    {
+      getDataLogger().restoreRecords(state.records, state.recordCount);
+    }
+    statusPrinter.printf("Warm boot: %s, %d records restored",
+                         getStateStr(detector.getState()), (int)getDataLogger().getBufferSize());
+  }
+  else
+  {
+    statusPrinter.printf("Taring...");
+    scale.tare();
+  }
+
   statusPrinter.printf("Ready!");
 
   // // DEBUG: add 20 fake measurements
@@ -224,98 +193,61 @@ void setup()
   // }
 }
 
-bool checkStability(float newValue)
-{
-  // Update stability window
-  stableReadings[stableIndex] = newValue;
-  stableIndex = (stableIndex + 1) % STABILITY_WINDOW;
-
-  // Wait for window to fill up
-  static bool windowFilled = false;
-  if (!windowFilled && stableIndex == 0)
-  {
-    windowFilled = true;
-  }
-  if (!windowFilled)
-  {
-    return false;
-  }
-
-  // Check all values in window
-  float minVal = stableReadings[0];
-  float maxVal = stableReadings[0];
-
-  for (int i = 1; i < STABILITY_WINDOW; i++)
-  {
-    float val = stableReadings[i];
-    minVal = min(minVal, val);
-    maxVal = max(maxVal, val);
-  }
-
-  float diff = maxVal - minVal;
-  bool stable = diff <= STABILITY_TOLERANCE;
-  statusPrinter.printfLevel(
-      2, "value=%6.1f window=[%6.1f %6.1f] diff=%6.1f -> %s\t|\t%s",
-      newValue, minVal, maxVal, diff,
-      stable ? "stable" : "unstable",
-      getStateStr(eventState)); // ← updated
-
-  return stable;
-}
-
 void loop()
 {
-  getBtServer().processCommands();
-
-  float rawValue = scale.get_units();
+  // Commands are handled on their own task (see BtServer::startCommandTask)
+  // Same as get_units() with the default scale of 1, but keeps the untouched
+  // count around for captureRaw
+  long raw = scale.read();
+  int64_t sampleUs = esp_timer_get_time();
+  getSamplingStats().record(sampleUs);
+  getRawCapture().add(raw, scale.get_offset(), sampleUs);
+
+  float rawValue = raw - scale.get_offset();
   // rawPrinter.printf("raw=%.1f", rawValue);
 
-  // Calculate weight with exponential moving average
-  if (emaValue == 0)
-  {
-    // Initialize EMA with first reading
-    emaValue = rawValue;
-  }
-  else
+  // Prefilter, EMA, grams conversion, stability window and the state machine
+  // all live in the detector now
+  int64_t detectStartUs = esp_timer_get_time();
+  DetectorEvent event = detector.update(rawValue);
+  getSamplingStats().recordDetect((uint32_t)(esp_timer_get_time() - detectStartUs),
+                                  detector.getPrefilter().getRejected());
+
+  if (getBootStats().firstSampleUs < 0 && detector.isWindowFilled())
   {
-    // EMA formula: EMAt = α * Xt + (1 - α) * EMAt-1
-    emaValue = EMA_ALPHA * rawValue + (1 - EMA_ALPHA) * emaValue;
+    getBootStats().firstSampleUs = esp_timer_get_time();
+    statusPrinter.printf("First valid sample %lu ms after boot (%s)",
+                         (unsigned long)(getBootStats().firstSampleUs / 1000),
+                         getBootStats().warmBoot ? "warm" : "cold");
   }
 
-  // Original
-  // o3: map(long, … ) in the Arduino core truncates to long, throwing away all sub‑gram precision.
-  // float grams = map(emaValue, CALIBRATION_AT_NO_LOAD, CALIBRATION_AT_LOAD_1, 0, WEIGHT_AT_LOAD_1);
-  float grams =
-      (emaValue - CALIBRATION_AT_NO_LOAD) *
-      (float)WEIGHT_AT_LOAD_1 /
-      (CALIBRATION_AT_LOAD_1 - CALIBRATION_AT_NO_LOAD);
-
-  grams = max(0.0f, grams);
-
-  // Round very small values to 0 to prevent noise
-  if (abs(grams) < 0.1)
+  if (detector.isWindowFilled())
   {
-    grams = 0;
+    statusPrinter.printfLevel(
+        2, "value=%6.1f window=[%6.1f %6.1f] diff=%6.1f -> %s\t|\t%s",
+        detector.getGrams(), detector.getWindowMin(), detector.getWindowMax(),
+        detector.getWindowMax() - detector.getWindowMin(),
+        detector.isStable() ? "stable" : "unstable",
+        getStateStr(detector.getState()));
   }
 
-  // Check stability on grams value after rounding
-  isStable = checkStability(grams);
+  processStateDetection(event);
 
-  // Process the state machine
-  processStateDetection(grams, isStable, wasStable);
+  // Evaluation sets see exactly the same samples as the live detector
+  getDetectorBank().update(rawValue);
 
-  // Update stability tracking
-  wasStable = isStable;
-
-  if (prevState != eventState)
+  if (prevState != detector.getState())
   {
-    statusPrinter.printfLevel(2, "*** %s\t→\t%s", getStateStr(prevState), getStateStr(eventState));
-    prevState = eventState;
+    statusPrinter.printfLevel(2, "*** %s\t→\t%s", getStateStr(prevState), getStateStr(detector.getState()));
+    prevState = detector.getState();
   }
 
-  // Record the measurement
-  // getDataLogger().addMeasurement(grams, isStable);
+  getWarmRestart().checkpoint(scale.get_offset(), detector.checkpoint(),
+                              lastCupTime, getDataLogger());
+
+  // Record the measurement; compressed into segments, so cheap to keep on
+  getDataLogger().addMeasurement(detector.getGrams(), detector.isStable());
 
   // Use task delay instead of blocking delay
-  vTaskDelay(pdMS_TO_TICKS(SAMPLING_RATE_MS));
+  vTaskDelay(pdMS_TO_TICKS(1000 / samplingRateHz.load()));
 }
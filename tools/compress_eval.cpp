@@ -0,0 +1,155 @@
+// Replays a recorded raw trace through the live detector's grams pipeline and
+// then through the measurement compressor, and checks the result. Build and
+// run from the repo root:
+//
+//   g++ -std=c++17 -O2 -Isrc -o compress_eval tools/compress_eval.cpp
+//   ./compress_eval [--cal noLoad,atLoad,weight] [mode,error ...] < trace.txt
+//
+// mode is "constant" or "linear"; default is both at 0.5 g. Trace lines are
+// "ms,raw" or just "raw" (then 10 ms apart, the firmware's sampling period).
+// The calibration comes from --cal or the trace's "# cal" line, as in
+// detector_eval.
+// For each setting it prints the compression ratio and the worst difference
+// between an input sample and the reconstructed series, which must not exceed
+// the error bound. Exits non-zero if it does.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "SipDetector.h"
+#include "SwingDoor.h"
+
+struct Sample
+{
+    EventTime t;
+    float grams;
+};
+
+// Value of the compressed series at time t
+static float reconstruct(CompressionMode mode, const std::vector<Segment> &segments, EventTime t)
+{
+    if (mode == COMPRESSION_CONSTANT)
+    {
+        for (const Segment &s : segments)
+        {
+            if (t >= s.start && t <= s.end)
+                return s.value;
+        }
+        return NAN;
+    }
+
+    for (size_t i = 1; i < segments.size(); i++)
+    {
+        const Segment &a = segments[i - 1];
+        const Segment &b = segments[i];
+        if (t >= a.start && t <= b.start)
+        {
+            if (b.start == a.start)
+                return b.value;
+            return a.value + (b.value - a.value) * (float)(t - a.start) / (float)(b.start - a.start);
+        }
+    }
+    return segments.size() == 1 && segments[0].start == t ? segments[0].value : NAN;
+}
+
+int main(int argc, char **argv)
+{
+    Calibration cal = {};
+    bool haveCal = false;
+    DetectorParams params = DEFAULT_DETECTOR_PARAMS;
+
+    std::vector<CompressionMode> modes;
+    std::vector<float> errors;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cal") == 0 && i + 1 < argc)
+        {
+            haveCal = sscanf(argv[++i], "%f,%f,%f", &cal.noLoad, &cal.atLoad, &cal.weight) == 3;
+            continue;
+        }
+        char mode[16];
+        float error;
+        if (sscanf(argv[i], "%15[a-z],%f", mode, &error) != 2 ||
+            (strcmp(mode, "constant") != 0 && strcmp(mode, "linear") != 0))
+        {
+            fprintf(stderr, "usage: %s [--cal noLoad,atLoad,weight] [constant|linear,error ...] < trace\n", argv[0]);
+            return 1;
+        }
+        modes.push_back(strcmp(mode, "linear") == 0 ? COMPRESSION_LINEAR : COMPRESSION_CONSTANT);
+        errors.push_back(error);
+    }
+    if (modes.empty())
+    {
+        modes = {COMPRESSION_CONSTANT, COMPRESSION_LINEAR};
+        errors = {0.5f, 0.5f};
+    }
+
+    std::vector<EventTime> times;
+    std::vector<float> raw;
+    char line[128];
+    EventTime t = 0;
+    while (fgets(line, sizeof(line), stdin))
+    {
+        Calibration header;
+        if (sscanf(line, "# cal %f,%f,%f", &header.noLoad, &header.atLoad, &header.weight) == 3 && !haveCal)
+        {
+            cal = header;
+            haveCal = true;
+        }
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        char *comma = strchr(line, ',');
+        if (comma)
+            t = strtoll(line, nullptr, 10);
+        else
+            t += 10;
+        times.push_back(t);
+        raw.push_back(strtof(comma ? comma + 1 : line, nullptr));
+    }
+    if (!haveCal)
+    {
+        fprintf(stderr, "no calibration: pass --cal or use a trace with a \"# cal\" line\n");
+        return 1;
+    }
+
+    SipDetector detector(params, cal);
+    std::vector<Sample> samples;
+    for (size_t i = 0; i < raw.size(); i++)
+    {
+        detector.update(raw[i]);
+        samples.push_back({times[i], detector.getGrams()});
+    }
+
+    int failures = 0;
+    printf("%zu samples\n", samples.size());
+    printf("%-9s %6s | %8s %8s %7s %9s\n", "mode", "error", "samples", "records", "ratio", "maxError");
+    for (size_t m = 0; m < modes.size(); m++)
+    {
+        SwingDoor door;
+        door.configure(modes[m], errors[m]);
+        std::vector<Segment> segments;
+        Segment out[SWING_DOOR_MAX_OUTPUT];
+        for (const Sample &s : samples)
+        {
+            int n = door.add(s.t, s.grams, out);
+            segments.insert(segments.end(), out, out + n);
+        }
+        int n = door.flush(out);
+        segments.insert(segments.end(), out, out + n);
+
+        float maxError = 0;
+        for (const Sample &s : samples)
+        {
+            float e = fabsf(reconstruct(modes[m], segments, s.t) - s.grams);
+            if (!(e <= maxError)) // also catches NaN
+                maxError = isnan(e) ? INFINITY : e;
+        }
+        bool ok = maxError <= errors[m] + 1e-3f;
+        failures += !ok;
+        printf("%-9s %6.2f | %8u %8u %7.1f %9.3f%s\n",
+               getCompressionModeStr(modes[m]), errors[m],
+               door.getInputs(), door.getOutputs(), door.getRatio(), maxError,
+               ok ? "" : "  EXCEEDS BOUND");
+    }
+    return failures ? 1 : 0;
+}
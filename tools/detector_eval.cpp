@@ -0,0 +1,131 @@
+// Host-side replay of recorded raw traces through several detector parameter
+// sets at once. Build and run from the repo root:
+//
+//   g++ -std=c++17 -O2 -Isrc -o detector_eval tools/detector_eval.cpp
+//   ./detector_eval [--cal noLoad,atLoad,weight] alpha,tol,window,zero,change[,median[,sigmas]] ... < trace.txt
+//
+// The trace is one sample per line; the last comma/space separated field is the
+// raw (tared) reading, so both "raw" and "ms,raw" lines work. Lines starting
+// with '#' are skipped, except "# cal noLoad,atLoad,weight", which bttest.py's
+// capture writes with the device's calibration. --cal overrides it; with
+// neither there is no way to tell grams from counts, so it refuses to run.
+//
+// median/sigmas configure the spike prefilter (see MedianFilter.h); left out,
+// they are the firmware's (DEFAULT_DETECTOR_PARAMS), and median 0 turns it
+// off. With no sets at all the firmware's is the one set. After the tallies it prints what each set costs per
+// sample on this machine, replaying the trace through a fresh detector.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "SipDetector.h"
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--cal noLoad,atLoad,weight] alpha,tol,window,zero,change[,median[,sigmas]] ... < trace\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    Calibration cal = {};
+    bool haveCal = false;
+    std::vector<DetectorParams> sets;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cal") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%f,%f,%f", &cal.noLoad, &cal.atLoad, &cal.weight) != 3)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            haveCal = true;
+            continue;
+        }
+
+        DetectorParams p = DEFAULT_DETECTOR_PARAMS;
+        if (sscanf(argv[i], "%f,%f,%d,%f,%f,%d,%f", &p.emaAlpha, &p.stabilityTolerance,
+                   &p.stabilityWindow, &p.zeroThreshold, &p.changeThreshold,
+                   &p.medianWindow, &p.outlierSigmas) < 5)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if ((int)sets.size() >= MAX_EVAL_SETS)
+        {
+            fprintf(stderr, "at most %d parameter sets\n", MAX_EVAL_SETS);
+            return 1;
+        }
+        sets.push_back(p);
+    }
+    if (sets.empty())
+        sets.push_back(DEFAULT_DETECTOR_PARAMS);
+
+    char line[128];
+    std::vector<float> trace;
+    while (fgets(line, sizeof(line), stdin))
+    {
+        Calibration header;
+        if (sscanf(line, "# cal %f,%f,%f", &header.noLoad, &header.atLoad, &header.weight) == 3 && !haveCal)
+        {
+            cal = header;
+            haveCal = true;
+        }
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        char *field = line;
+        for (char *c = line; *c; c++)
+        {
+            if (*c == ',' || *c == ' ' || *c == '\t')
+                field = c + 1;
+        }
+        trace.push_back(strtof(field, nullptr));
+    }
+    if (!haveCal)
+    {
+        fprintf(stderr, "no calibration: pass --cal or use a trace with a \"# cal\" line\n");
+        return 1;
+    }
+
+    DetectorBank bank;
+    bank.setCalibration(cal);
+    for (const DetectorParams &p : sets)
+        bank.add(p);
+    for (float raw : trace)
+        bank.update(raw);
+
+    printf("%zu samples\n", trace.size());
+    printf("%-5s %6s %6s %6s %6s %6s %6s %6s | %5s %9s %7s %9s %5s %8s %8s\n",
+           "set", "alpha", "tol", "window", "zero", "change", "median", "sigmas",
+           "sips", "sipGrams", "refills", "refillG", "noops", "rejected", "ns/samp");
+    for (int i = 0; i < bank.size(); i++)
+    {
+        const DetectorParams &p = bank.getDetector(i).getParams();
+        DetectorTally t = bank.getTally(i);
+
+        // Best of a few passes, so a context switch does not count
+        double best = 0;
+        volatile int sink = 0;
+        for (int pass = 0; pass < 5 && !trace.empty(); pass++)
+        {
+            SipDetector d(p, cal);
+            auto start = std::chrono::steady_clock::now();
+            for (float raw : trace)
+                sink += d.update(raw);
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / trace.size();
+            if (pass == 0 || ns < best)
+                best = ns;
+        }
+        (void)sink;
+
+        printf("%-5d %6.2f %6.2f %6d %6.2f %6.2f %6d %6.2f | %5lu %9.1f %7lu %9.1f %5lu %8lu %8.1f\n",
+               i, p.emaAlpha, p.stabilityTolerance, p.stabilityWindow,
+               p.zeroThreshold, p.changeThreshold, p.medianWindow, p.outlierSigmas,
+               t.sips, t.sipGrams, t.refills, t.refillGrams, t.noops, t.rejected, best);
+    }
+    return 0;
+}
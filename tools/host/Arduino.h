@@ -0,0 +1,195 @@
+#pragma once
+// Just enough of the Arduino-ESP32 core to compile the firmware's headers on a
+// Linux host (see tools/loopback_bench.cpp). Time is virtual: millis(),
+// micros() and esp_timer_get_time() only move when the harness advances
+// hostClockUs, so runs are reproducible.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/time.h>
+#include <string>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+#define IRAM_ATTR
+
+inline int64_t hostClockUs = 0;
+inline bool hostSerialEcho = false; // firmware Serial output to stderr
+
+class String
+{
+private:
+    std::string s;
+
+public:
+    String() {}
+    String(const char *c) : s(c ? c : "") {}
+    String(const std::string &c) : s(c) {}
+    String(char c) : s(1, c) {}
+    String(int v) : s(std::to_string(v)) {}
+    String(unsigned v) : s(std::to_string(v)) {}
+    String(long v) : s(std::to_string(v)) {}
+    String(unsigned long v) : s(std::to_string(v)) {}
+    String(long long v) : s(std::to_string(v)) {}
+    String(unsigned long long v) : s(std::to_string(v)) {}
+    String(float v, unsigned d = 2) { format(v, d); }
+    String(double v, unsigned d = 2) { format(v, d); }
+
+    void format(double v, unsigned d)
+    {
+        char b[64];
+        snprintf(b, sizeof(b), "%.*f", d, v);
+        s = b;
+    }
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned length() const { return s.size(); }
+    bool isEmpty() const { return s.empty(); }
+    int indexOf(char c, unsigned from = 0) const
+    {
+        size_t p = s.find(c, from);
+        return p == std::string::npos ? -1 : (int)p;
+    }
+    int indexOf(const String &c, unsigned from = 0) const
+    {
+        size_t p = s.find(c.s, from);
+        return p == std::string::npos ? -1 : (int)p;
+    }
+    String substring(unsigned a) const { return a >= s.size() ? String() : String(s.substr(a)); }
+    String substring(unsigned a, unsigned b) const { return a >= s.size() ? String() : String(s.substr(a, b - a)); }
+    long toInt() const { return atol(s.c_str()); }
+    float toFloat() const { return atof(s.c_str()); }
+    bool startsWith(const String &p) const { return s.rfind(p.s, 0) == 0; }
+    char charAt(unsigned i) const { return s[i]; }
+    char operator[](unsigned i) const { return s[i]; }
+    void trim()
+    {
+        while (!s.empty() && isspace((unsigned char)s.back()))
+            s.pop_back();
+        size_t i = 0;
+        while (i < s.size() && isspace((unsigned char)s[i]))
+            i++;
+        s.erase(0, i);
+    }
+    bool reserve(unsigned n)
+    {
+        s.reserve(n);
+        return true;
+    }
+    bool concat(const char *o, unsigned n)
+    {
+        s.append(o, n);
+        return true;
+    }
+    String &operator+=(const String &o)
+    {
+        s += o.s;
+        return *this;
+    }
+    String &operator+=(const char *o)
+    {
+        s += o;
+        return *this;
+    }
+    String &operator+=(char c)
+    {
+        s += c;
+        return *this;
+    }
+    friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+    friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+    friend String operator+(const char *a, const String &b) { return String(a + b.s); }
+    bool operator==(const String &o) const { return s == o.s; }
+    bool operator==(const char *o) const { return s == o; }
+    bool operator!=(const char *o) const { return s != o; }
+};
+
+class HardwareSerial
+{
+private:
+    static void write(const char *text)
+    {
+        if (hostSerialEcho)
+            fputs(text, stderr);
+    }
+
+public:
+    void begin(int) {}
+    void print(const String &v) { write(v.c_str()); }
+    void print(const char *v) { write(v); }
+    template <class T>
+    void print(const T &v) { print(String(v)); }
+    void println() { write("\n"); }
+    template <class T>
+    void println(const T &v)
+    {
+        print(v);
+        println();
+    }
+    int printf(const char *format, ...)
+    {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        write(buffer);
+        return n;
+    }
+};
+
+inline HardwareSerial Serial;
+
+inline unsigned long millis() { return (unsigned long)(hostClockUs / 1000); }
+inline unsigned long micros() { return (unsigned long)hostClockUs; }
+inline void delay(unsigned long ms) { hostClockUs += (int64_t)ms * 1000; }
+inline void delayMicroseconds(unsigned us) { hostClockUs += us; }
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+
+struct EspClass
+{
+    void restart()
+    {
+        fprintf(stderr, "ESP.restart() called on host\n");
+        exit(2);
+    }
+    uint32_t getFreeHeap() { return 0; }
+};
+inline EspClass ESP;
+
+// FreeRTOS: the harness drives everything from one thread, so tasks are
+// never started and notifications are no-ops
+typedef int BaseType_t;
+typedef unsigned TickType_t;
+typedef void *TaskHandle_t;
+#define pdMS_TO_TICKS(x) (x)
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffff
+#define portTICK_PERIOD_MS 1
+
+inline void vTaskDelay(TickType_t) {}
+inline BaseType_t xTaskCreatePinnedToCore(void (*)(void *), const char *, uint32_t, void *,
+                                          unsigned, TaskHandle_t *handle, int)
+{
+    if (handle)
+        *handle = nullptr;
+    return pdFALSE;
+}
+inline void vTaskDelete(TaskHandle_t) {}
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+inline int xPortGetCoreID() { return 0; }
@@ -0,0 +1,252 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include "Transport.h"
+
+// In-process stand-in for the BLE link, for driving BtServer from a host
+// harness. It models what bounds throughput on the real link rather than the
+// radio itself:
+//
+//  - ATT MTU: a notification carries at most mtu - 3 bytes; longer ones are
+//    cut off, exactly like BLECharacteristic::notify() does.
+//  - Link-layer fragmentation: each ATT packet gets a 4 byte L2CAP header and
+//    is split into PDUs of at most llPayload bytes (27, or 251 with data
+//    length extension). Every PDU costs PDU_OVERHEAD bytes on air on top.
+//  - Connection interval and credits: data only moves at connection events,
+//    and each side sends at most `credits` PDUs per event.
+//  - Packet loss: each PDU is lost with probability `loss` and retransmitted
+//    at the next opportunity, costing air time and a credit.
+//  - Writes are Write Requests: the client has one outstanding until the
+//    Write Response comes back, as with bleak's write_gatt_char.
+//  - Notifications go through a bounded TX queue; when it is full they are
+//    dropped, as the BLE stack does when congested.
+//
+// The random source is seeded, so a run is reproducible.
+
+#define PDU_OVERHEAD 10  // preamble, access address, header, CRC (1M PHY)
+#define L2CAP_HEADER 4
+#define ATT_HEADER 3     // opcode + handle
+#define ATT_WRITE_RESPONSE 1
+
+struct LinkParams
+{
+    int mtu = 517; // what desktop stacks negotiate with the ESP32
+    int llPayload = 251;
+    int intervalMs = 30;
+    int credits = 4;
+    double loss = 0;
+    size_t txQueue = 10; // notifications
+    uint32_t seed = 1;
+};
+
+struct LinkStats
+{
+    uint64_t bytesOnAir = 0;
+    uint64_t payloadBytes = 0; // ATT values actually delivered
+    uint32_t pdus = 0;
+    uint32_t lostPdus = 0;
+    uint32_t events = 0;
+    uint32_t notifications = 0;
+    uint32_t truncated = 0;
+    uint32_t droppedNotifications = 0;
+    uint32_t writes = 0;
+};
+
+class LoopbackTransport : public Transport
+{
+public:
+    typedef std::function<void(const std::string &value)> ClientHandler;
+
+private:
+    enum PacketKind
+    {
+        PACKET_WRITE,
+        PACKET_WRITE_RESPONSE,
+        PACKET_NOTIFICATION
+    };
+
+    struct Packet
+    {
+        PacketKind kind;
+        std::string value;
+        int fragmentsLeft;
+        bool started;
+    };
+
+    LinkParams params;
+    LinkStats stats;
+    bool connected = false;
+    bool writePending = false;
+    std::deque<Packet> toServer;
+    std::deque<Packet> toClient;
+    ClientHandler clientHandler;
+    uint64_t rng;
+
+    // xorshift64*, so runs do not depend on the C library
+    double random()
+    {
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return ((rng * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    int fragmentsFor(size_t attLength) const
+    {
+        size_t sdu = attLength + L2CAP_HEADER;
+        return (int)((sdu + params.llPayload - 1) / params.llPayload);
+    }
+
+    Packet makePacket(PacketKind kind, const std::string &value)
+    {
+        size_t attLength = kind == PACKET_WRITE_RESPONSE ? ATT_WRITE_RESPONSE : ATT_HEADER + value.size();
+        return {kind, value, fragmentsFor(attLength), false};
+    }
+
+    size_t pendingNotifications() const
+    {
+        size_t n = 0;
+        for (const Packet &p : toClient)
+            n += p.kind == PACKET_NOTIFICATION;
+        return n;
+    }
+
+    // One PDU from the front of `queue`; true if a packet completed
+    bool transmit(std::deque<Packet> &queue, Packet *completed)
+    {
+        stats.pdus++;
+        if (queue.empty())
+        {
+            stats.bytesOnAir += PDU_OVERHEAD; // empty PDU
+            return false;
+        }
+
+        Packet &p = queue.front();
+        size_t attLength = p.kind == PACKET_WRITE_RESPONSE ? ATT_WRITE_RESPONSE : ATT_HEADER + p.value.size();
+        size_t sdu = attLength + L2CAP_HEADER;
+        size_t sent = (size_t)(fragmentsFor(attLength) - p.fragmentsLeft) * params.llPayload;
+        size_t length = std::min((size_t)params.llPayload, sdu - sent);
+        stats.bytesOnAir += PDU_OVERHEAD + length;
+        p.started = true;
+
+        if (random() < params.loss)
+        {
+            stats.lostPdus++;
+            return false;
+        }
+        if (--p.fragmentsLeft > 0)
+            return false;
+
+        *completed = p;
+        queue.pop_front();
+        return true;
+    }
+
+    void deliverToServer(const Packet &p)
+    {
+        // Goes ahead of queued notifications, but cannot interrupt one that
+        // is half way out
+        auto at = toClient.begin();
+        if (at != toClient.end() && at->started)
+            ++at;
+        toClient.insert(at, makePacket(PACKET_WRITE_RESPONSE, ""));
+        if (receiveHandler)
+            receiveHandler(p.value.data(), p.value.size());
+    }
+
+    void deliverToClient(const Packet &p)
+    {
+        if (p.kind == PACKET_WRITE_RESPONSE)
+        {
+            writePending = false;
+            return;
+        }
+        stats.payloadBytes += p.value.size();
+        if (clientHandler)
+            clientHandler(p.value);
+    }
+
+public:
+    LoopbackTransport(const LinkParams &linkParams) : params(linkParams), rng(linkParams.seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+    // Transport, seen from BtServer
+
+    void begin() override
+    {
+        connected = true;
+        if (connectionHandler)
+            connectionHandler(true);
+    }
+
+    bool isConnected() const override { return connected; }
+
+    bool send(const char *data, size_t length) override
+    {
+        if (!connected)
+            return false;
+        if (length > getMaxPayload())
+        {
+            length = getMaxPayload();
+            stats.truncated++;
+        }
+        if (pendingNotifications() >= params.txQueue)
+        {
+            stats.droppedNotifications++;
+            return false;
+        }
+        toClient.push_back(makePacket(PACKET_NOTIFICATION, std::string(data, length)));
+        stats.notifications++;
+        return true;
+    }
+
+    size_t getMaxPayload() const override { return params.mtu - ATT_HEADER; }
+
+    // The client end
+
+    void setClientHandler(ClientHandler handler) { clientHandler = handler; }
+
+    bool canWrite() const { return connected && !writePending; }
+
+    bool write(const std::string &value)
+    {
+        if (!canWrite() || value.size() > getMaxPayload())
+            return false;
+        toServer.push_back(makePacket(PACKET_WRITE, value));
+        writePending = true;
+        stats.writes++;
+        return true;
+    }
+
+    void disconnect()
+    {
+        connected = false;
+        toServer.clear();
+        toClient.clear();
+        writePending = false;
+        if (connectionHandler)
+            connectionHandler(false);
+    }
+
+    // One connection event: central and peripheral alternate PDUs until
+    // neither has more data or the credits run out
+    void runConnectionEvent()
+    {
+        stats.events++;
+        for (int i = 0; i < params.credits; i++)
+        {
+            Packet p;
+            if (transmit(toServer, &p))
+                deliverToServer(p);
+            if (transmit(toClient, &p))
+                deliverToClient(p);
+            if (toServer.empty() && toClient.empty())
+                break;
+        }
+    }
+
+    int getIntervalMs() const { return params.intervalMs; }
+    const LinkParams &getParams() const { return params; }
+    const LinkStats &getStats() const { return stats; }
+};
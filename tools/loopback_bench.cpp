@@ -0,0 +1,351 @@
+// End-to-end export benchmark without a board: the real BtServer and
+// DataLogger run on the host over LoopbackTransport, which models the BLE
+// link's MTU, connection interval, per-event credits and packet loss. Build
+// and run from the repo root:
+//
+//   g++ -std=c++17 -O2 -Itools/host -Isrc -o loopback_bench tools/loopback_bench.cpp
+//   ./loopback_bench [--records n] [--mtu bytes] [--ll bytes] [--interval-ms ms]
+//                    [--credits pdus] [--loss p] [--queue n] [--page n]
+//                    [--window n] [--timeout-ms ms] [--retries n] [--seed n] [-v]
+//
+// The client does what bttest.py's demo_data_fetch does: getStatus, then
+// pipelined "#<id> readRange <seq> <page>" requests keeping the device's
+// window full, follow-ups for pages that came back short, then dropBefore
+// for what it read. A reply that does not arrive (lost to a full TX queue, or
+// cut off at the MTU so it does not parse) times out and is retried. The page
+// defaults to what the device reports for the MTU. Time is virtual, so for
+// the same options the numbers are identical on every run.
+//
+// It also times, in real host CPU time, what an export costs the sampling
+// loop: each processCommands() call, which the loop sat through when it
+// called it inline, and the copy of one page under the buffer lock, which is
+// all an append can wait for now that commands run on their own task. Those
+// two lines vary from run to run.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "BtServer.h"
+#include "LoopbackTransport.h"
+
+struct Request
+{
+    std::string command;
+    int tries;
+    int64_t sentUs;
+};
+
+struct BenchClient
+{
+    LoopbackTransport &link;
+    int window = 1;
+    int64_t timeoutUs = 5000000;
+    int maxRetries = 3;
+
+    long nextId = 1;
+    std::vector<std::string> backlog; // not yet sent
+    int pendingTries = 0;             // tries already spent on backlog.front()
+    std::map<long, Request> inFlight;
+    std::vector<std::string> replies; // completed, in arrival order
+    uint32_t failed = 0;
+    uint32_t retries = 0;
+    uint32_t unparsed = 0;
+
+    BenchClient(LoopbackTransport &l) : link(l)
+    {
+        link.setClientHandler([this](const std::string &value)
+                              { onNotification(value); });
+    }
+
+    void onNotification(const std::string &value)
+    {
+        // Tagged replies start with {"id":<n>; a truncated one does not end
+        // in '}' and would not parse on a real client either
+        long id;
+        if (value.empty() || value.back() != '}' || sscanf(value.c_str(), "{\"id\":%ld", &id) != 1)
+        {
+            unparsed++;
+            return;
+        }
+        auto it = inFlight.find(id);
+        if (it == inFlight.end())
+            return; // reply to a request we already gave up on
+        inFlight.erase(it);
+        replies.push_back(value);
+    }
+
+    void request(const std::string &command) { backlog.push_back(command); }
+
+    bool idle() const { return backlog.empty() && inFlight.empty(); }
+
+    // Called once per connection event
+    void poll(bool retryOnTimeout)
+    {
+        for (auto it = inFlight.begin(); it != inFlight.end();)
+        {
+            Request &r = it->second;
+            if (hostClockUs - r.sentUs < timeoutUs)
+            {
+                ++it;
+                continue;
+            }
+            if (retryOnTimeout && r.tries <= maxRetries)
+            {
+                retries++;
+                backlog.insert(backlog.begin(), r.command);
+                pendingTries = r.tries;
+            }
+            else
+            {
+                failed++;
+            }
+            it = inFlight.erase(it);
+        }
+
+        // One write per round trip, like write_gatt_char with response
+        if (!backlog.empty() && (int)inFlight.size() < window && link.canWrite())
+        {
+            long id = nextId++;
+            std::string line = "#" + std::to_string(id) + " " + backlog.front() + "\n";
+            if (link.write(line))
+            {
+                inFlight[id] = {backlog.front(), pendingTries + 1, hostClockUs};
+                backlog.erase(backlog.begin());
+                pendingTries = 0;
+            }
+        }
+    }
+};
+
+struct Timings
+{
+    typedef std::chrono::steady_clock Clock;
+    std::vector<double> us;
+
+    void add(Clock::time_point start)
+    {
+        us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    double median()
+    {
+        if (us.empty())
+            return 0;
+        std::nth_element(us.begin(), us.begin() + us.size() / 2, us.end());
+        return us[us.size() / 2];
+    }
+
+    double max() const { return us.empty() ? 0 : *std::max_element(us.begin(), us.end()); }
+};
+
+static long jsonField(const std::string &json, const char *name, long fallback = -1)
+{
+    std::string key = std::string("\"") + name + "\":";
+    size_t at = json.find(key);
+    if (at == std::string::npos)
+        return fallback;
+    return atol(json.c_str() + at + key.size());
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--records n] [--mtu bytes] [--ll bytes] [--interval-ms ms] [--credits pdus]\n"
+            "          [--loss p] [--queue n] [--page n] [--window n] [--timeout-ms ms]\n"
+            "          [--retries n] [--seed n] [-v]\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    LinkParams params;
+    int records = 200;
+    int page = 0;   // 0 = what the device reports, like demo_data_fetch
+    int window = 0; // 0 = what the device reports
+    int timeoutMs = 5000;
+    int maxRetries = 3;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (strcmp(arg, "-v") == 0)
+        {
+            hostSerialEcho = true;
+            continue;
+        }
+        if (!value)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+        if (strcmp(arg, "--records") == 0)
+            records = atoi(value);
+        else if (strcmp(arg, "--mtu") == 0)
+            params.mtu = atoi(value);
+        else if (strcmp(arg, "--ll") == 0)
+            params.llPayload = atoi(value);
+        else if (strcmp(arg, "--interval-ms") == 0)
+            params.intervalMs = atoi(value);
+        else if (strcmp(arg, "--credits") == 0)
+            params.credits = atoi(value);
+        else if (strcmp(arg, "--loss") == 0)
+            params.loss = atof(value);
+        else if (strcmp(arg, "--queue") == 0)
+            params.txQueue = atoi(value);
+        else if (strcmp(arg, "--page") == 0)
+            page = atoi(value);
+        else if (strcmp(arg, "--window") == 0)
+            window = atoi(value);
+        else if (strcmp(arg, "--timeout-ms") == 0)
+            timeoutMs = atoi(value);
+        else if (strcmp(arg, "--retries") == 0)
+            maxRetries = atoi(value);
+        else if (strcmp(arg, "--seed") == 0)
+            params.seed = strtoul(value, nullptr, 10);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (params.mtu < 23 || params.llPayload < 27 || params.intervalMs < 1 || params.credits < 1 ||
+        page < 0 || records < 0 || params.loss < 0 || params.loss >= 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Fixed epoch so record JSON, and with it every byte count, is reproducible
+    EventTime base = 1700000000000LL;
+    DataLogger &logger = getDataLogger();
+    logger.setLoggingEnabled(true);
+    for (int i = 0; i < records; i++)
+    {
+        EventTime start = base + (EventTime)i * 61000;
+        logger.addRecord(start, start + 2500, 12.5f + i % 40, i % 3 ? SIP : REFILL);
+    }
+
+    std::atomic<int> samplingRateHz{100};
+    LoopbackTransport link(params);
+    BtServer server(link, samplingRateHz);
+    server.setup();
+
+    BenchClient client(link);
+    client.timeoutUs = (int64_t)timeoutMs * 1000;
+    client.maxRetries = maxRetries;
+
+    Timings commandTimes;
+
+    // Runs connection events until the client has nothing outstanding
+    auto runUntilIdle = [&](bool retry)
+    {
+        while (!client.idle())
+        {
+            client.poll(retry);
+            link.runConnectionEvent();
+            auto start = Timings::Clock::now();
+            server.processCommands();
+            commandTimes.add(start);
+            hostClockUs += (int64_t)params.intervalMs * 1000;
+        }
+    };
+
+    client.request("getStatus");
+    runUntilIdle(true);
+    if (client.replies.empty())
+    {
+        fprintf(stderr, "no reply to getStatus (%u truncated at mtu %d)\n",
+                link.getStats().truncated, params.mtu);
+        return 1;
+    }
+    long total = jsonField(client.replies[0], "bufferSize", 0);
+    long first = jsonField(client.replies[0], "firstSeq", 0);
+    long end = jsonField(client.replies[0], "nextSeq", 0);
+    client.window = window > 0 ? window : (int)jsonField(client.replies[0], "window", 1);
+    if (page == 0)
+        page = (int)jsonField(client.replies[0], "page", 1);
+    client.replies.clear();
+
+    // Read phase: pages of seqs [first + k * page, ...). A page that came
+    // back short ("next" before its end) is finished with another request
+    // until [first, end) is covered.
+    int64_t readStartUs = hostClockUs;
+    uint64_t readStartBytes = link.getStats().bytesOnAir;
+    for (long seq = first; seq < end; seq += page)
+        client.request("readRange " + std::to_string(seq) + " " + std::to_string(std::min((long)page, end - seq)));
+    long recordsRead = 0;
+    long readUpTo = first;
+    std::map<long, long> covered; // from -> next
+    while (true)
+    {
+        runUntilIdle(true);
+        for (const std::string &reply : client.replies)
+        {
+            recordsRead += jsonField(reply, "length", 0);
+            long &next = covered[jsonField(reply, "from", 0)];
+            next = std::max(next, jsonField(reply, "next", 0));
+        }
+        client.replies.clear();
+
+        for (const auto &c : covered)
+        {
+            if (c.first <= readUpTo)
+                readUpTo = std::max(readUpTo, c.second);
+        }
+        if (readUpTo >= end || client.failed)
+            break;
+        long pageEnd = std::min(first + ((readUpTo - first) / page + 1) * page, end);
+        client.request("readRange " + std::to_string(readUpTo) + " " + std::to_string(pageEnd - readUpTo));
+    }
+    int64_t readUs = hostClockUs - readStartUs;
+    uint64_t readBytes = link.getStats().bytesOnAir - readStartBytes;
+    uint32_t readFailed = client.failed;
+
+    // The part of a readRange that holds the buffer lock
+    Timings copyTimes;
+    std::vector<Record> copy(page);
+    for (int i = 0; i < 1000; i++)
+    {
+        uint32_t next;
+        auto start = Timings::Clock::now();
+        logger.copyFromSeq(first, page, copy.data(), &next);
+        copyTimes.add(start);
+    }
+
+    // Drop phase: dropBefore is idempotent, so it can be retried
+    client.request("dropBefore " + std::to_string(readUpTo));
+    runUntilIdle(true);
+    uint32_t dropFailed = client.failed - readFailed;
+
+    const LinkStats &s = link.getStats();
+    double readSeconds = readUs / 1e6;
+    printf("link: mtu=%d ll=%d interval=%dms credits=%d loss=%.3f queue=%zu seed=%u\n",
+           params.mtu, params.llPayload, params.intervalMs, params.credits, params.loss,
+           params.txQueue, params.seed);
+    printf("client: page=%d window=%d timeout=%dms retries=%d\n",
+           page, client.window, timeoutMs, maxRetries);
+    printf("records read:      %ld of %ld\n", recordsRead, total);
+    printf("read time:         %.3f s\n", readSeconds);
+    printf("records/sec:       %.1f\n", readSeconds > 0 ? recordsRead / readSeconds : 0.0);
+    printf("bytes on air:      %llu read phase, %llu total\n",
+           (unsigned long long)readBytes, (unsigned long long)s.bytesOnAir);
+    printf("air bytes/record:  %.1f\n", recordsRead ? (double)readBytes / recordsRead : 0.0);
+    printf("goodput:           %.0f B/s over the whole run\n", hostClockUs ? s.payloadBytes / (hostClockUs / 1e6) : 0.0);
+    printf("connection events: %u, PDUs %u, lost %u\n", s.events, s.pdus, s.lostPdus);
+    printf("notifications:     %u sent, %u truncated, %u dropped (queue full)\n",
+           s.notifications, s.truncated, s.droppedNotifications);
+    printf("requests:          %u retried, %u read failed, %u drop unconfirmed, %u unparsed replies\n",
+           client.retries, readFailed, dropFailed, client.unparsed);
+    printf("left on device:    %zu\n", logger.getBufferSize());
+    printf("processCommands(): %.1f us median, %.1f us max (host CPU)\n",
+           commandTimes.median(), commandTimes.max());
+    printf("page copy:         %.2f us median, %.2f us max (host CPU, under the lock)\n",
+           copyTimes.median(), copyTimes.max());
+    return readFailed || recordsRead != total ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+"""Synthetic raw trace for tools/detector_eval and tools/compress_eval.
+
+A cup is put on the scale, then lifted, sipped from and put back a number of
+times, with a refill every fourth time, sampled every 10 ms like the firmware
+does. Readings are tared counts plus Gaussian noise. With --spikes, single
+readings are off by 3 to 40 g now and then, like a knock on the table or a
+bad HX711 conversion: what the median prefilter is for. The output has the
+same "ms,raw" format and "# cal" header as a `bttest.py capture`, so the
+tools run on it unchanged:
+
+    python3 tools/make_trace.py --seed 1 > trace.txt
+    ./compress_eval < trace.txt
+"""
+
+import argparse
+import random
+
+# The firmware's default (OFFICE_SET) calibration, see main.cpp
+DEFAULT_CAL = "-400,998000,950"
+PERIOD_MS = 10
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--cycles", type=int, default=12, help="lift/sip/put-back cycles")
+    parser.add_argument("--noise", type=float, default=60, help="standard deviation, counts")
+    parser.add_argument("--spikes", type=float, default=0, help="probability per sample")
+    parser.add_argument("--cal", default=DEFAULT_CAL, help="noLoad,atLoad,weight")
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    no_load, at_load, weight = (float(x) for x in args.cal.split(","))
+    counts_per_gram = (at_load - no_load) / weight
+
+    print(
+        f"# make_trace.py seed={args.seed} cycles={args.cycles} "
+        f"noise={args.noise:g} spikes={args.spikes:g}"
+    )
+    print(f"# cal {args.cal}")
+
+    t = 0
+    spikes = 0
+
+    def hold(grams: float, seconds: float):
+        nonlocal t, spikes
+        for _ in range(round(seconds * 1000 / PERIOD_MS)):
+            raw = no_load + grams * counts_per_gram + rng.gauss(0, args.noise)
+            if args.spikes and rng.random() < args.spikes:
+                raw += rng.choice([-1, 1]) * rng.uniform(3, 40) * counts_per_gram
+                spikes += 1
+            print(f"{t},{round(raw)}")
+            t += PERIOD_MS
+
+    cup = 350.0
+    hold(0, 5)
+    hold(cup, 15)  # put down
+    for i in range(args.cycles):
+        hold(0, 3)  # lifted
+        cup += 80 if i % 4 == 3 else -15
+        hold(cup, 20)
+    hold(0, 5)
+    print(f"# {spikes} spikes")
+
+
+if __name__ == "__main__":
+    main()